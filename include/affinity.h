@@ -0,0 +1,58 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** affinity.h
+** 
+** CPU list parsing and thread affinity
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <sstream>
+
+#include "logger.h"
+
+// parse a CPU list like 0,2-3 into a CPU set, false if it is not valid
+inline bool parseCpuList(const std::string & list, cpu_set_t & set) {
+	CPU_ZERO(&set);
+	std::istringstream is(list);
+	std::string range;
+	while (std::getline(is, range, ',')) {
+		int first = 0, last = 0;
+		int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+		if (count == 1) {
+			last = first;
+		}
+		if ( (count < 1) || (first < 0) || (last < first) || (last >= CPU_SETSIZE) ) {
+			return false;
+		}
+		for (int cpu = first; cpu <= last; ++cpu) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return CPU_COUNT(&set) > 0;
+}
+
+// pin the calling thread to a CPU list
+inline bool setThreadAffinity(const std::string & list) {
+	cpu_set_t set;
+	if (!parseCpuList(list, set)) {
+		LOG(WARN) << "Cannot parse CPU list:" << list;
+		return false;
+	}
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		LOG(WARN) << "Cannot set affinity to CPU " << list << " " << strerror(ret);
+		return false;
+	}
+	return true;
+}
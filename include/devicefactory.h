@@ -0,0 +1,36 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** devicefactory.h
+**
+** Create a V4L2 device, or a file/pipe stand-in for file: and pipe: names
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "V4l2Capture.h"
+#include "V4l2Output.h"
+
+#include "filedevice.h"
+
+class DeviceFactory {
+    public:
+    static V4l2Capture* CreateCapture(const V4L2DeviceParameters & param, V4l2Access::IoType iotype) {
+        FileUri uri;
+        if (uri.parse(param.m_devName)) {
+            return FileCapture::create(param, uri);
+        }
+        return V4l2Capture::create(param, iotype);
+    }
+
+    static V4l2Output* CreateOutput(const V4L2DeviceParameters & param, V4l2Access::IoType iotype) {
+        FileUri uri;
+        if (uri.parse(param.m_devName)) {
+            return FileOutput::create(param, uri);
+        }
+        return V4l2Output::create(param, iotype);
+    }
+};
@@ -9,10 +9,256 @@
 
 #pragma once
 
+#include <sys/uio.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <vector>
+#include <memory>
+#include <deque>
+#include <map>
+#include <string>
+
+#include "V4l2Output.h"
+#include "yuvconverter.h"
+#include "latency.h"
+#include "frameinfo.h"
+#include "mmapoutput.h"
+
+/* destination of the compressed frames */
+class FrameSink {
+    public:
+        virtual ~FrameSink() {}
+
+        virtual int write(char* buffer, unsigned int size) = 0;
+
+        // capture time and sequence number of the frame written next
+        virtual void setFrameInfo(const FrameInfo &) {}
+
+        // write one frame made of several parts
+        virtual int writev(const struct iovec* iov, int iovcnt) {
+            int size = 0;
+            for (int i=0; i < iovcnt; ++i) {
+                size += this->write((char*)iov[i].iov_base, iov[i].iov_len);
+            }
+            return size;
+        }
+};
+
+/* write compressed frames to a V4L2 output device, with their capture timestamp when its buffers are mapped */
+class V4l2OutputSink : public FrameSink {
+    public:
+        V4l2OutputSink(V4l2Output* videoOutput, MmapOutput* mmapOutput = NULL) : m_videoOutput(videoOutput), m_mmapOutput(mmapOutput) {}
+
+        void setFrameInfo(const FrameInfo & info) {
+            m_info = info;
+        }
+
+        int write(char* buffer, unsigned int size) {
+            if (m_mmapOutput && m_mmapOutput->isReady()) {
+                struct iovec iov = { buffer, size };
+                return m_mmapOutput->write(&iov, 1, m_info);
+            }
+            return m_videoOutput->write(buffer, size);
+        }
+
+        // copy the parts directly in the queued output buffer when possible
+        int writev(const struct iovec* iov, int iovcnt) {
+            int size = 0;
+            if (m_mmapOutput && m_mmapOutput->isReady()) {
+                size = m_mmapOutput->write(iov, iovcnt, m_info);
+            } else if (m_videoOutput->startPartialWrite()) {
+                for (int i=0; i < iovcnt; ++i) {
+                    size += m_videoOutput->writePartial((char*)iov[i].iov_base, iov[i].iov_len);
+                }
+                m_videoOutput->endPartialWrite();
+            } else {
+                m_buffer.clear();
+                for (int i=0; i < iovcnt; ++i) {
+                    m_buffer.insert(m_buffer.end(), (char*)iov[i].iov_base, (char*)iov[i].iov_base + iov[i].iov_len);
+                }
+                size = m_videoOutput->write(m_buffer.data(), m_buffer.size());
+            }
+            return size;
+        }
+
+    private:
+        V4l2Output*       m_videoOutput;
+        MmapOutput*       m_mmapOutput;
+        FrameInfo         m_info;
+        std::vector<char> m_buffer;
+};
+
+/* measure the time spent and the bytes written to an other sink */
+class TimedSink : public FrameSink {
+    public:
+        TimedSink(FrameSink* sink) : m_sink(sink), m_elapsed(0), m_bytes(0) {}
+
+        int write(char* buffer, unsigned int size) {
+            uint64_t start = monotonicNow();
+            int ret = m_sink->write(buffer, size);
+            m_elapsed += monotonicNow() - start;
+            m_bytes += (ret > 0) ? ret : 0;
+            return ret;
+        }
+
+        void setFrameInfo(const FrameInfo & info) {
+            m_sink->setFrameInfo(info);
+        }
+
+        int writev(const struct iovec* iov, int iovcnt) {
+            uint64_t start = monotonicNow();
+            int ret = m_sink->writev(iov, iovcnt);
+            m_elapsed += monotonicNow() - start;
+            m_bytes += (ret > 0) ? ret : 0;
+            return ret;
+        }
+
+        // nanoseconds spent writing since the last call
+        uint64_t takeElapsed() {
+            uint64_t elapsed = m_elapsed;
+            m_elapsed = 0;
+            return elapsed;
+        }
+
+        // bytes written since the last call
+        int takeBytes() {
+            int bytes = m_bytes;
+            m_bytes = 0;
+            return bytes;
+        }
+
+    private:
+        FrameSink* m_sink;
+        uint64_t   m_elapsed;
+        int        m_bytes;
+};
+
+/* append compressed frames to a memory buffer, keep the info of the last one if asked */
+class BufferSink : public FrameSink {
+    public:
+        BufferSink(std::vector<char> & buffer, FrameInfo* info = NULL) : m_buffer(buffer), m_info(info) {}
+
+        void setFrameInfo(const FrameInfo & info) {
+            if (m_info) {
+                *m_info = info;
+            }
+        }
+
+        int write(char* buffer, unsigned int size) {
+            m_buffer.insert(m_buffer.end(), buffer, buffer+size);
+            return size;
+        }
+
+    private:
+        std::vector<char> & m_buffer;
+        FrameInfo*          m_info;
+};
+
 class Encoder {
     public:
+        Encoder() : m_convertTime(0), m_lastPts(0), m_stripes(1) {}
         virtual ~Encoder() {}
 
-        virtual void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) = 0;
+        // number of horizontal stripes converted in parallel
+        void setStripes(int stripes) {
+            m_stripes = stripes;
+            m_converter.reset();
+        }
+
+        virtual void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) = 0;
+
+        // write the frames delayed in the encoder
+        virtual void flush(FrameSink*) {}
+
+        void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) {
+            V4l2OutputSink sink(videoOutput);
+            this->convertEncodeWrite(buffer, rsize, format, &sink);
+        }
+
+        void flush(V4l2Output* videoOutput) {
+            V4l2OutputSink sink(videoOutput);
+            this->flush(&sink);
+        }
+
+        // nanoseconds spent converting the last frame to the encoder input
+        uint64_t getConvertTime() const { return m_convertTime; }
+
+        // capture time and sequence number of the next frame to encode
+        void setFrameInfo(const FrameInfo & info) { m_info = info; }
+
+        // frame rate given by the FPS option as num[/den], 25 by default
+        static void getFrameRate(const std::map<std::string,std::string> & opt, int & num, int & den) {
+            num = 25;
+            den = 1;
+            std::map<std::string,std::string>::const_iterator fps = opt.find("FPS");
+            if ( (fps != opt.end()) && (sscanf(fps->second.c_str(), "%d/%d", &num, &den) < 1) ) {
+                num = 25;
+            }
+            if ( (num <= 0) || (den <= 0) ) {
+                num = 25;
+                den = 1;
+            }
+        }
+
+    protected:
+        // keep the info of the frame given to the encoder until it comes out, return its pts in microseconds
+        // the capture time, or the current time when it is unknown, made increasing
+        int64_t pushFrameInfo() {
+            FrameInfo info = m_info;
+            m_info = FrameInfo();
+            if (info.m_timestamp == 0) {
+                info.m_timestamp = monotonicNow()/1000;
+            }
+            if (info.m_timestamp <= m_lastPts) {
+                info.m_timestamp = m_lastPts + 1;
+            }
+            m_lastPts = info.m_timestamp;
+            if (m_pending.size() >= 256) {
+                m_pending.pop_front();
+            }
+            m_pending.push_back(info);
+            return info.m_timestamp;
+        }
+
+        // the info of the encoded frame with this pts, the ones skipped by the encoder are forgotten
+        FrameInfo popFrameInfo(int64_t pts) {
+            while (!m_pending.empty() && ((int64_t)m_pending.front().m_timestamp < pts)) {
+                m_pending.pop_front();
+            }
+            FrameInfo info;
+            info.m_timestamp = pts;
+            if (!m_pending.empty() && ((int64_t)m_pending.front().m_timestamp == pts)) {
+                info = m_pending.front();
+                m_pending.pop_front();
+            }
+            return info;
+        }
+
+        // the info of a frame encoded without delay
+        FrameInfo takeFrameInfo() {
+            return this->popFrameInfo(this->pushFrameInfo());
+        }
+
+        // convert a captured frame to I420 planes
+        int convertToI420(const char* buffer, unsigned int rsize, int format, int width, int height, 
+                          uint8* y, int ystride, uint8* u, int ustride, uint8* v, int vstride) {
+            if ( !m_converter || (m_converter->getInputFormat() != format) || (m_converter->getWidth() != width) || (m_converter->getHeight() != height) ) {
+                m_converter.reset(new YuvConverter(format, V4L2_PIX_FMT_YUV420, width, height));
+                m_converter->setStripes(m_stripes);
+            }
+            YuvImage dst = { { y, u, v }, { ystride, ustride, vstride } };
+            return m_converter->convert(buffer, rsize, dst);
+        }
+
+        // nanoseconds spent preparing the I420 input of the last frame, measured by the encoders
+        uint64_t                      m_convertTime;
+        FrameInfo                     m_info;
+
+    private:
+        std::deque<FrameInfo>         m_pending;
+        uint64_t                      m_lastPts;
+        int                           m_stripes;
+        std::unique_ptr<YuvConverter> m_converter;
 };
 
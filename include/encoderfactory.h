@@ -20,7 +20,10 @@
 #ifdef HAVE_VPX   
 #include "vpxencoder.h"
 #endif
-#ifdef HAVE_JPEG  
+#ifdef HAVE_TURBOJPEG
+#include "turbojpegencoder.h"
+#endif
+#ifdef HAVE_JPEG
 #include "jpegencoder.h"
 #endif
 
@@ -39,10 +42,25 @@ class EncoderFactory {
             case V4L2_PIX_FMT_VP8: encoder = new VpxEncoder(format, width, height, opt, verbose); break;
             case V4L2_PIX_FMT_VP9: encoder = new VpxEncoder(format, width, height, opt, verbose); break;
 #endif            
-#ifdef HAVE_JPEG            
+#if defined(HAVE_TURBOJPEG) && defined(HAVE_JPEG)
+            // TurboJPEG cannot encode slices in parallel, libjpeg does
+            case V4L2_PIX_FMT_JPEG:
+                if ( (opt.find("SLICES") != opt.end()) && (std::stoi(opt.at("SLICES")) > 1) ) {
+                    encoder = new JpegEncoder(format, width, height, opt, verbose);
+                } else {
+                    encoder = new TurboJpegEncoder(format, width, height, opt, verbose);
+                }
+                break;
+#elif defined(HAVE_TURBOJPEG)
+            case V4L2_PIX_FMT_JPEG: encoder = new TurboJpegEncoder(format, width, height, opt, verbose); break;
+#elif defined(HAVE_JPEG)
             case V4L2_PIX_FMT_JPEG: encoder = new JpegEncoder(format, width, height, opt, verbose); break;
 #endif            
         }
+        std::map<std::string,std::string>::const_iterator stripes = opt.find("STRIPES");
+        if ( (encoder != NULL) && (stripes != opt.end()) ) {
+            encoder->setStripes(std::stoi(stripes->second));
+        }
         return encoder;
     }
 
@@ -58,7 +76,7 @@ class EncoderFactory {
         formatList.push_back(V4L2_PIX_FMT_VP8);    
         formatList.push_back(V4L2_PIX_FMT_VP9);  
 #endif            
-#ifdef HAVE_JPEG 
+#if defined(HAVE_JPEG) || defined(HAVE_TURBOJPEG)
         formatList.push_back(V4L2_PIX_FMT_JPEG);            
 #endif              
         return formatList;      
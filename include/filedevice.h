@@ -0,0 +1,415 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** filedevice.h
+**
+** Capture from and output to files or pipes instead of V4L2 devices
+**   file:path?fmt=YUYV&size=640x480&fps=25&loop=1  (path - for stdin/stdout)
+**   pipe:command?fmt=H264                          (run by the shell)
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "logger.h"
+#include "V4l2Device.h"
+#include "V4l2Capture.h"
+#include "V4l2Output.h"
+
+/* a device name file:path?key=value&... or pipe:command?key=value&... */
+struct FileUri {
+	bool parse(const std::string & devname) {
+		size_t colon = devname.find(':');
+		if (colon == std::string::npos) {
+			return false;
+		}
+		m_scheme = devname.substr(0, colon);
+		if ( (m_scheme != "file") && (m_scheme != "pipe") ) {
+			return false;
+		}
+		m_path = devname.substr(colon+1);
+		size_t question = m_path.rfind('?');
+		if (question != std::string::npos) {
+			std::string query = m_path.substr(question+1);
+			m_path.erase(question);
+			size_t pos = 0;
+			while (pos <= query.size()) {
+				size_t amp = query.find('&', pos);
+				if (amp == std::string::npos) {
+					amp = query.size();
+				}
+				std::string param = query.substr(pos, amp-pos);
+				size_t equal = param.find('=');
+				if (equal != std::string::npos) {
+					m_query[param.substr(0, equal)] = param.substr(equal+1);
+				} else if (!param.empty()) {
+					m_query[param] = "1";
+				}
+				pos = amp+1;
+			}
+		}
+		return !m_path.empty();
+	}
+
+	std::string get(const std::string & key, const std::string & value = "") const {
+		std::map<std::string,std::string>::const_iterator it = m_query.find(key);
+		return (it != m_query.end()) ? it->second : value;
+	}
+
+	std::string                        m_scheme;
+	std::string                        m_path;
+	std::map<std::string,std::string>  m_query;
+};
+
+/* a file, a pipe or stdin/stdout behaving like a V4L2 device, frames are paced at the given framerate */
+class FileDevice : public V4l2Device {
+	public:
+		FileDevice(const V4L2DeviceParameters & params, v4l2_buf_type deviceType, const FileUri & uri)
+			: V4l2Device(params, deviceType), m_uri(uri), m_capture(deviceType == V4L2_BUF_TYPE_VIDEO_CAPTURE), m_pipe(NULL), m_frameSize(0), m_compressed(false), m_loop(false), m_looped(true), m_period(0), m_next(0) {
+			m_fd = -1;
+			m_bufferSize = 0;
+			m_format = 0;
+			m_width = params.m_width;
+			m_height = params.m_height;
+		}
+
+		~FileDevice() {
+			if (m_pipe) {
+				pclose(m_pipe);
+				m_fd = -1;
+			}
+		}
+
+		// open the file and describe the frames it holds
+		bool init(unsigned int) {
+			std::string format = m_uri.get("fmt");
+			if (!format.empty()) {
+				m_format = V4l2Device::fourcc(format.c_str());
+			} else if (!m_params.m_formatList.empty()) {
+				m_format = m_params.m_formatList.front();
+			}
+			if (m_format == 0) {
+				m_format = m_capture ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_JPEG;
+			}
+			std::string size = m_uri.get("size");
+			if (!size.empty() && (sscanf(size.c_str(), "%ux%u", &m_width, &m_height) != 2) ) {
+				LOG(WARN) << "unsupported size:" << size;
+				return false;
+			}
+
+			m_compressed = (m_format == V4L2_PIX_FMT_JPEG) || (m_format == V4L2_PIX_FMT_MJPEG) || (m_format == V4L2_PIX_FMT_H264) || (m_format == V4L2_PIX_FMT_HEVC);
+			m_frameSize = rawFrameSize(m_format, m_width, m_height);
+			if (m_compressed) {
+				m_bufferSize = std::max(m_width*m_height*2, 2u*1024*1024);
+			} else if (m_frameSize != 0) {
+				m_bufferSize = m_frameSize;
+			} else if (m_capture) {
+				LOG(WARN) << "cannot read " << V4l2Device::fourcc(m_format) << " frames of size " << m_width << "x" << m_height << " from " << m_uri.m_path;
+				return false;
+			}
+
+			int fps = atoi(m_uri.get("fps", m_params.m_fps ? std::to_string(m_params.m_fps) : "25").c_str());
+			m_period = (m_capture && fps > 0) ? 1000000000ULL/fps : 0;
+			m_loop = (m_uri.get("loop", "0") != "0");
+
+			if (m_uri.m_scheme == "pipe") {
+				m_pipe = popen(m_uri.m_path.c_str(), m_capture ? "r" : "w");
+				m_fd = m_pipe ? fileno(m_pipe) : -1;
+			} else if (m_uri.m_path == "-") {
+				m_fd = dup(m_capture ? STDIN_FILENO : STDOUT_FILENO);
+			} else {
+				m_fd = m_capture ? ::open(m_uri.m_path.c_str(), O_RDONLY) : ::open(m_uri.m_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+			}
+			if (m_fd == -1) {
+				LOG(WARN) << "Cannot open " << m_uri.m_scheme << ":" << m_uri.m_path << " " << strerror(errno);
+				return false;
+			}
+			LOG(NOTICE) << m_uri.m_scheme << ":" << m_uri.m_path << " format:" << V4l2Device::fourcc(m_format) << " size:" << m_width << "x" << m_height << " bufferSize:" << m_bufferSize << ((m_capture && !m_period) ? " unpaced" : "");
+			return true;
+		}
+
+		// size of an uncompressed frame, 0 if the format is not known
+		static unsigned int rawFrameSize(unsigned int format, unsigned int width, unsigned int height) {
+			unsigned int cwidth = (width+1)/2;
+			unsigned int cheight = (height+1)/2;
+			switch (format) {
+				case V4L2_PIX_FMT_GREY:    return width*height;
+				case V4L2_PIX_FMT_YUV420:
+				case V4L2_PIX_FMT_YVU420:
+				case V4L2_PIX_FMT_NV12:
+				case V4L2_PIX_FMT_NV21:    return width*height + 2*cwidth*cheight;
+				case V4L2_PIX_FMT_YUV422P:
+				case V4L2_PIX_FMT_NV16:
+				case V4L2_PIX_FMT_NV61:    return width*height + 2*cwidth*height;
+				case V4L2_PIX_FMT_YUYV:
+				case V4L2_PIX_FMT_YVYU:
+				case V4L2_PIX_FMT_UYVY:
+				case V4L2_PIX_FMT_VYUY:
+				case V4L2_PIX_FMT_RGB565:  return 2*width*height;
+				case V4L2_PIX_FMT_BGR24:
+				case V4L2_PIX_FMT_RGB24:   return 3*width*height;
+				case V4L2_PIX_FMT_BGR32:
+				case V4L2_PIX_FMT_RGB32:   return 4*width*height;
+			}
+			return 0;
+		}
+
+		// end of the first JPEG picture, 0 if it is not complete
+		static size_t jpegFrameEnd(const unsigned char* data, size_t size) {
+			size_t i = 0;
+			while ( (i+1 < size) && !((data[i] == 0xFF) && (data[i+1] == 0xD8)) ) {
+				i++;
+			}
+			i += 2;
+			while (i+1 < size) {
+				unsigned char marker = data[i+1];
+				if ( (data[i] != 0xFF) || (marker == 0xFF) ) {
+					i++;
+				} else if (marker == 0xD9) {
+					return i+2;
+				} else if ( ((marker >= 0xD0) && (marker <= 0xD7)) || (marker == 0x01) ) {
+					i += 2;
+				} else if (i+3 < size) {
+					i += 2 + ((data[i+2] << 8) | data[i+3]);
+					if (marker == 0xDA) {
+						// entropy coded data up to the next marker that is not a restart
+						while ( (i+1 < size) && !((data[i] == 0xFF) && (data[i+1] != 0) && ((data[i+1] < 0xD0) || (data[i+1] > 0xD7))) ) {
+							i++;
+						}
+					}
+				} else {
+					break;
+				}
+			}
+			return 0;
+		}
+
+		// start of the second access unit of an Annex-B stream, 0 if it is not complete
+		static size_t annexbFrameEnd(const unsigned char* data, size_t size, bool hevc) {
+			bool vcl = false;
+			for (size_t i = 0; i+2 < size; ++i) {
+				if ( (data[i] != 0) || (data[i+1] != 0) || (data[i+2] != 1) ) {
+					continue;
+				}
+				size_t nal = i+3;
+				if (nal+2 >= size) {
+					break;
+				}
+				bool slice, first, austart;
+				if (hevc) {
+					int type = (data[nal] >> 1) & 0x3f;
+					slice    = (type < 32);
+					first    = (data[nal+2] & 0x80);
+					austart  = ((type >= 32) && (type <= 35)) || (type == 39) || ((type >= 41) && (type <= 44)) || ((type >= 48) && (type <= 55));
+				} else {
+					int type = data[nal] & 0x1f;
+					slice    = (type >= 1) && (type <= 5);
+					first    = (data[nal+1] & 0x80);
+					austart  = ((type >= 6) && (type <= 9)) || ((type >= 14) && (type <= 18));
+				}
+				if (vcl && ((slice && first) || austart)) {
+					return ( (i > 0) && (data[i-1] == 0) ) ? i-1 : i;
+				}
+				vcl |= slice;
+				i = nal;
+			}
+			return 0;
+		}
+
+	protected:
+		size_t readInternal(char* buffer, size_t bufferSize) {
+			this->pace();
+			int size = m_compressed ? this->readCompressed(buffer, bufferSize) : this->readRaw(buffer, bufferSize);
+			if (size == 0) {
+				LOG(NOTICE) << "End of " << m_uri.m_scheme << ":" << m_uri.m_path;
+				errno = ENODATA;
+				size = -1;
+			}
+			return size;
+		}
+
+		size_t writeInternal(char* buffer, size_t bufferSize) {
+			size_t written = 0;
+			while (written < bufferSize) {
+				ssize_t size = ::write(m_fd, buffer + written, bufferSize - written);
+				if ( (size == -1) && (errno == EINTR) ) {
+					continue;
+				}
+				if (size <= 0) {
+					return -1;
+				}
+				written += size;
+			}
+			return written;
+		}
+
+		// there is no buffer to fill in place, the parts are written as they come
+		bool startPartialWrite()                                  { return true; }
+		size_t writePartialInternal(char* buffer, size_t size)    { return this->writeInternal(buffer, size); }
+		bool endPartialWrite()                                    { return true; }
+
+	private:
+		// wait for the time of the next frame, a late reader does not get a burst
+		void pace() {
+			if (m_period == 0) {
+				return;
+			}
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t now = ts.tv_sec*1000000000ULL + ts.tv_nsec;
+			if (m_next + m_period < now) {
+				m_next = now;
+			}
+			ts.tv_sec  = m_next / 1000000000ULL;
+			ts.tv_nsec = m_next % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+			m_next += m_period;
+		}
+
+		// read up to size bytes, less only at the end of the file
+		int readFull(char* buffer, size_t size) {
+			size_t done = 0;
+			while (done < size) {
+				ssize_t ret = ::read(m_fd, buffer + done, size - done);
+				if ( (ret == -1) && (errno == EINTR) ) {
+					continue;
+				}
+				if (ret == -1) {
+					return -1;
+				}
+				if (ret == 0) {
+					break;
+				}
+				done += ret;
+				m_looped = false;
+			}
+			return done;
+		}
+
+		// restart from the beginning when looping on a regular file that is not empty
+		bool rewind() {
+			if (!m_loop || m_looped) {
+				return false;
+			}
+			m_looped = true;
+			return (lseek(m_fd, 0, SEEK_SET) == 0);
+		}
+
+		int readRaw(char* buffer, size_t bufferSize) {
+			char* frame = buffer;
+			if (bufferSize < m_frameSize) {
+				m_pending.resize(m_frameSize);
+				frame = m_pending.data();
+			}
+			int size = this->readFull(frame, m_frameSize);
+			if ( (size == 0) && this->rewind() ) {
+				size = this->readFull(frame, m_frameSize);
+			}
+			if ( (size > 0) && ((unsigned int)size < m_frameSize) ) {
+				LOG(WARN) << "Truncated frame " << size << "/" << m_frameSize;
+				size = 0;
+			}
+			if ( (size > 0) && (frame != buffer) ) {
+				LOG(WARN) << "Buffer too small " << bufferSize << "/" << m_frameSize;
+				memcpy(buffer, frame, bufferSize);
+				size = bufferSize;
+			}
+			return size;
+		}
+
+		// split the stream in pictures or access units
+		int readCompressed(char* buffer, size_t bufferSize) {
+			size_t frameSize = 0;
+			while ( (frameSize = this->frameEnd()) == 0 ) {
+				size_t pending = m_pending.size();
+				m_pending.resize(pending + 256*1024);
+				int size = this->readFull(m_pending.data() + pending, 256*1024);
+				m_pending.resize(pending + std::max(size, 0));
+				if (size == -1) {
+					return -1;
+				}
+				if ( (size == 0) && !m_pending.empty() ) {
+					// the last frame ends with the file
+					frameSize = m_pending.size();
+					break;
+				}
+				if ( (size == 0) && !this->rewind() ) {
+					return 0;
+				}
+			}
+			if (frameSize > bufferSize) {
+				LOG(WARN) << "Buffer too small " << bufferSize << "/" << frameSize;
+			}
+			size_t size = std::min(frameSize, bufferSize);
+			memcpy(buffer, m_pending.data(), size);
+			m_pending.erase(m_pending.begin(), m_pending.begin() + frameSize);
+			return size;
+		}
+
+		size_t frameEnd() {
+			const unsigned char* data = (const unsigned char*)m_pending.data();
+			if ( (m_format == V4L2_PIX_FMT_H264) || (m_format == V4L2_PIX_FMT_HEVC) ) {
+				return annexbFrameEnd(data, m_pending.size(), m_format == V4L2_PIX_FMT_HEVC);
+			}
+			return jpegFrameEnd(data, m_pending.size());
+		}
+
+	private:
+		FileUri           m_uri;
+		bool              m_capture;
+		FILE*             m_pipe;
+		unsigned int      m_frameSize;
+		bool              m_compressed;
+		bool              m_loop;
+		bool              m_looped;
+		uint64_t          m_period;
+		uint64_t          m_next;
+		std::vector<char> m_pending;
+};
+
+class FileCapture : public V4l2Capture {
+	public:
+		static V4l2Capture* create(const V4L2DeviceParameters & param, const FileUri & uri) {
+			FileDevice* device = new FileDevice(param, V4L2_BUF_TYPE_VIDEO_CAPTURE, uri);
+			if (!device->init(0)) {
+				delete device;
+				return NULL;
+			}
+			return new FileCapture(device);
+		}
+
+	protected:
+		FileCapture(V4l2Device* device) : V4l2Capture(device) {}
+};
+
+class FileOutput : public V4l2Output {
+	public:
+		static V4l2Output* create(const V4L2DeviceParameters & param, const FileUri & uri) {
+			FileDevice* device = new FileDevice(param, V4L2_BUF_TYPE_VIDEO_OUTPUT, uri);
+			if (!device->init(0)) {
+				delete device;
+				return NULL;
+			}
+			return new FileOutput(device);
+		}
+
+	protected:
+		FileOutput(V4l2Device* device) : V4l2Output(device) {}
+};
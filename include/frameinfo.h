@@ -0,0 +1,31 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** frameinfo.h
+** 
+** Capture time and sequence number carried with a frame
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+
+struct FrameInfo {
+	FrameInfo() : m_timestamp(0), m_sequence(0) {}
+	FrameInfo(const timeval & tv, uint32_t sequence) : m_timestamp(tv.tv_sec*1000000ULL + tv.tv_usec), m_sequence(sequence) {}
+
+	timeval getTimeval() const {
+		timeval tv;
+		tv.tv_sec = m_timestamp / 1000000;
+		tv.tv_usec = m_timestamp % 1000000;
+		return tv;
+	}
+
+	// microseconds of the V4L2 timestamp (CLOCK_MONOTONIC), 0 when unknown
+	uint64_t m_timestamp;
+	uint32_t m_sequence;
+};
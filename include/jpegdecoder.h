@@ -0,0 +1,244 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** jpegdecoder.h
+** 
+** Uncompress JPEG frames to YUYV, UYVY or I420
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <linux/videodev2.h>
+
+#include <vector>
+
+#include "libyuv.h"
+#include "logger.h"
+
+#include <jpeglib.h>
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+// DCT scaled sizes, renamed by libjpeg 7
+#if JPEG_LIB_VERSION >= 70
+#define MIN_DCT_SCALED_SIZE(cinfo) ((cinfo).min_DCT_v_scaled_size)
+#define DCT_H_SCALED_SIZE(comp)    ((comp).DCT_h_scaled_size)
+#define DCT_V_SCALED_SIZE(comp)    ((comp).DCT_v_scaled_size)
+#else
+#define MIN_DCT_SCALED_SIZE(cinfo) ((cinfo).min_DCT_scaled_size)
+#define DCT_H_SCALED_SIZE(comp)    ((comp).DCT_scaled_size)
+#define DCT_V_SCALED_SIZE(comp)    ((comp).DCT_scaled_size)
+#endif
+
+/* ---------------------------------------------------------------------------
+**  convert uncompressed 4:2:0 or 4:2:2 planes to the output format
+** -------------------------------------------------------------------------*/
+inline unsigned int convertPlanes(int format, bool is422, unsigned char* const planes[3], const int strides[3], int width, int height, std::vector<unsigned char> & out)
+{
+	int cwidth = (width+1)/2;
+	int cheight = (height+1)/2;
+	switch (format) {
+		case V4L2_PIX_FMT_YUYV:
+			out.resize(width*height*2);
+			if (is422) {
+				libyuv::I422ToYUY2(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], out.data(), width*2, width, height);
+			} else {
+				libyuv::I420ToYUY2(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], out.data(), width*2, width, height);
+			}
+			break;
+		case V4L2_PIX_FMT_UYVY:
+			out.resize(width*height*2);
+			if (is422) {
+				libyuv::I422ToUYVY(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], out.data(), width*2, width, height);
+			} else {
+				libyuv::I420ToUYVY(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], out.data(), width*2, width, height);
+			}
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			out.resize(width*height + 2*cwidth*cheight);
+			if (is422) {
+				libyuv::I422ToI420(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], 
+					out.data(), width, out.data() + width*height, cwidth, out.data() + width*height + cwidth*cheight, cwidth, width, height);
+			} else {
+				libyuv::I420Copy(planes[0], strides[0], planes[1], strides[1], planes[2], strides[2], 
+					out.data(), width, out.data() + width*height, cwidth, out.data() + width*height + cwidth*cheight, cwidth, width, height);
+			}
+			break;
+		default:
+			LOG(WARN) << "unsupported output format:" << format; 
+			return 0;
+	}
+	return out.size();
+}
+
+/* ---------------------------------------------------------------------------
+**  uncompress using libjpeg
+** -------------------------------------------------------------------------*/
+class JpegDecoder {
+	public:
+		JpegDecoder(int format = V4L2_PIX_FMT_YUYV, int scale = 1) : m_format(format), m_scale(scale) {
+			m_cinfo.err = jpeg_std_error(&m_jerr);
+			jpeg_create_decompress(&m_cinfo);
+		}
+		~JpegDecoder() {
+			jpeg_destroy_decompress(&m_cinfo);
+		}
+
+		// uncompress a JPEG frame to the output format, return the frame size or 0
+		unsigned int decode(const unsigned char* jpegBuffer, unsigned int jpegSize) {
+			return this->decode(jpegBuffer, jpegSize, m_out);
+		}
+
+		unsigned int decode(const unsigned char* jpegBuffer, unsigned int jpegSize, std::vector<unsigned char> & out) {
+			jpeg_mem_src(&m_cinfo, (unsigned char*)jpegBuffer, jpegSize);	
+			if (jpeg_read_header(&m_cinfo, TRUE) != JPEG_HEADER_OK) {
+				LOG(WARN) << "jpeg_read_header failed"; 
+				jpeg_abort_decompress(&m_cinfo);
+				return 0;
+			}
+			LOG(DEBUG) << "width:" << m_cinfo.image_width << " height:" << m_cinfo.image_height << " num_components:" << m_cinfo.num_components; 
+
+			// only 4:2:0 and 4:2:2 YCbCr can be read as raw planes
+			bool is422 = (m_cinfo.comp_info[0].v_samp_factor == 1);
+			if ( (m_cinfo.num_components != 3) || (m_cinfo.comp_info[0].h_samp_factor != 2) || (m_cinfo.comp_info[0].v_samp_factor > 2) 
+			  || (m_cinfo.comp_info[1].h_samp_factor != 1) || (m_cinfo.comp_info[1].v_samp_factor != 1)
+			  || (m_cinfo.comp_info[2].h_samp_factor != 1) || (m_cinfo.comp_info[2].v_samp_factor != 1) ) {
+				LOG(WARN) << "unsupported JPEG sampling"; 
+				jpeg_abort_decompress(&m_cinfo);
+				return 0;
+			}
+			
+			m_cinfo.raw_data_out = TRUE;
+			m_cinfo.out_color_space = JCS_YCbCr;
+			// reduced size decoding is done by the IDCT
+			m_cinfo.scale_num = 1;
+			m_cinfo.scale_denom = m_scale;
+			jpeg_start_decompress(&m_cinfo);
+
+			// planes padded to complete MCU rows, reused while the size does not change
+			// when scaling, the chroma blocks are scaled less than the luma ones, each component has its own rows
+			int mcuLines = m_cinfo.max_v_samp_factor*MIN_DCT_SCALED_SIZE(m_cinfo);
+			int mcuRows = (m_cinfo.output_height + mcuLines - 1)/mcuLines;
+			int strides[3];
+			int lines[3];
+			int offsets[3];
+			int size = 0;
+			for (int i = 0; i < 3; ++i) {
+				const jpeg_component_info & comp = m_cinfo.comp_info[i];
+				strides[i] = comp.width_in_blocks*DCT_H_SCALED_SIZE(comp);
+				lines[i] = comp.v_samp_factor*DCT_V_SCALED_SIZE(comp);
+				offsets[i] = size;
+				size += strides[i]*mcuRows*lines[i];
+				m_rows[i].resize(lines[i]);
+			}
+			m_planes.resize(size);
+			unsigned char* planes[3] = { m_planes.data() + offsets[0], m_planes.data() + offsets[1], m_planes.data() + offsets[2] };
+
+			JSAMPARRAY rows[3] = { m_rows[0].data(), m_rows[1].data(), m_rows[2].data() };
+			while (m_cinfo.output_scanline < m_cinfo.output_height) {
+				int mcuRow = m_cinfo.output_scanline/mcuLines;
+				for (int i = 0; i < 3; ++i) {
+					for (int j = 0; j < lines[i]; ++j) {
+						m_rows[i][j] = planes[i] + (mcuRow*lines[i] + j)*strides[i];
+					}
+				}
+				if (jpeg_read_raw_data(&m_cinfo, rows, mcuLines) == 0) {
+					break;
+				}
+			}	
+			int width = m_cinfo.output_width;
+			int height = m_cinfo.output_height;
+			int cwidth = m_cinfo.comp_info[1].downsampled_width;
+			int cheight = m_cinfo.comp_info[1].downsampled_height;
+			jpeg_finish_decompress(&m_cinfo);
+
+			// chroma decoded at a higher resolution than the sampling, downsample it
+			int subwidth = (width+1)/2;
+			int subheight = is422 ? height : (height+1)/2;
+			if ( (cwidth != subwidth) || (cheight != subheight) ) {
+				m_chroma.resize(2*subwidth*subheight);
+				for (int i = 1; i < 3; ++i) {
+					unsigned char* plane = m_chroma.data() + (i-1)*subwidth*subheight;
+					libyuv::ScalePlane(planes[i], strides[i], cwidth, cheight, plane, subwidth, subwidth, subheight, libyuv::kFilterBox);
+					planes[i] = plane;
+					strides[i] = subwidth;
+				}
+			}
+
+			return convertPlanes(m_format, is422, planes, strides, width, height, out);
+		}
+
+		const unsigned char* data() const { return m_out.data(); }
+
+	private:
+		int                           m_format;
+		int                           m_scale;
+		struct jpeg_error_mgr         m_jerr;
+		struct jpeg_decompress_struct m_cinfo;	
+		std::vector<unsigned char>    m_planes;
+		std::vector<unsigned char>    m_chroma;
+		std::vector<JSAMPROW>         m_rows[3];
+		std::vector<unsigned char>    m_out;
+};
+
+#ifdef HAVE_TURBOJPEG
+/* ---------------------------------------------------------------------------
+**  uncompress using TurboJPEG
+** -------------------------------------------------------------------------*/
+class TurboJpegDecoder {
+	public:
+		TurboJpegDecoder(int format = V4L2_PIX_FMT_YUYV, int scale = 1) : m_format(format), m_scale(scale), m_handle(tjInitDecompress()) {}
+		~TurboJpegDecoder() { tjDestroy(m_handle); }
+
+		// uncompress a JPEG frame to the output format, return the frame size or 0
+		unsigned int decode(const unsigned char* jpegBuffer, unsigned int jpegSize) {
+			return this->decode(jpegBuffer, jpegSize, m_out);
+		}
+
+		unsigned int decode(const unsigned char* jpegBuffer, unsigned int jpegSize, std::vector<unsigned char> & out) {
+			int width = 0;
+			int height = 0;
+			int subsamp = 0;
+			int colorspace = 0;
+			if (tjDecompressHeader3(m_handle, (unsigned char*)jpegBuffer, jpegSize, &width, &height, &subsamp, &colorspace) != 0) {
+				LOG(WARN) << "tjDecompressHeader3 " << tjGetErrorStr(); 
+				return 0;
+			}
+			if ( (subsamp != TJSAMP_420) && (subsamp != TJSAMP_422) ) {
+				LOG(WARN) << "unsupported subsampling:" << subsamp; 
+				return 0;
+			}
+
+			// reduced size decoding is done by the IDCT
+			tjscalingfactor factor = { 1, m_scale };
+			width = TJSCALED(width, factor);
+			height = TJSCALED(height, factor);
+
+			// planar buffer reused while the size does not change
+			int cwidth = tjPlaneWidth(1, width, subsamp);
+			int cheight = tjPlaneHeight(1, height, subsamp);
+			m_planes.resize(width*height + 2*cwidth*cheight);
+			unsigned char* planes[3] = { m_planes.data(), m_planes.data() + width*height, m_planes.data() + width*height + cwidth*cheight };
+			int strides[3] = { width, cwidth, cwidth };
+			if (tjDecompressToYUVPlanes(m_handle, (unsigned char*)jpegBuffer, jpegSize, planes, width, strides, height, 0) != 0) {
+				LOG(WARN) << "tjDecompressToYUVPlanes " << tjGetErrorStr(); 
+				return 0;
+			}
+
+			return convertPlanes(m_format, (subsamp == TJSAMP_422), planes, strides, width, height, out);
+		}
+
+		const unsigned char* data() const { return m_out.data(); }
+
+	private:
+		int                        m_format;
+		int                        m_scale;
+		tjhandle                   m_handle;
+		std::vector<unsigned char> m_planes;
+		std::vector<unsigned char> m_out;
+};
+#endif
@@ -9,9 +9,16 @@
 
 #pragma once
 
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <vector>
+#include <memory>
+
 #include "libyuv.h"
 #include "logger.h"
 #include "encoder.h"
+#include "workerpool.h"
 
 #include <jpeglib.h>
 
@@ -23,77 +30,265 @@ class JpegEncoder : public Encoder {
 			: m_width(width)
 			, m_height(height) {	
 
-			jpeg_create_compress(&m_cinfo);
-			m_cinfo.image_width = width;
-			m_cinfo.image_height = height;
-			m_cinfo.input_components = 3;	
-			m_cinfo.in_color_space = JCS_YCbCr; 
-			m_cinfo.err = jpeg_std_error(&m_jerr);
-
-			jpeg_set_defaults(&m_cinfo);
-			std::map<std::string,std::string>::const_iterator quality = opt.find("QUALITY");
-			if (quality != opt.end()) {
-				int value = std::stoi(quality->second);
-				jpeg_set_quality(&m_cinfo, value, TRUE);
-			}
-			std::map<std::string,std::string>::const_iterator dri = opt.find("DRI");
-			if (dri != opt.end()) {
-				int value = std::stoi(dri->second);
-				m_cinfo.restart_interval = value;
-			}						
+			this->init(m_cinfo, m_jerr, height, opt);
 
 			m_i420buffer = new unsigned char [width*height*3/2];
+
+			// destination buffer reused for each frame
+			m_jpegsize = width*height*3/2;
+			m_jpegbuffer = (unsigned char*)malloc(m_jpegsize);
+
+			// horizontal bands encoded in parallel, each band is a whole number of
+			// 8 MCU rows so that the restart markers of the bands chain RST0..RST7
+			int slices = 1;
+			std::map<std::string,std::string>::const_iterator slicesIt = opt.find("SLICES");
+			if (slicesIt != opt.end()) {
+				slices = std::stoi(slicesIt->second);
+			}
+			int bandHeight = 8*2*DCTSIZE;
+			int nbBands = (height + bandHeight - 1) / bandHeight;
+			slices = std::min(slices, nbBands);
+			if (slices > 1) {
+				if (opt.find("DRI") != opt.end()) {
+					LOG(WARN) << "DRI ignored, slices restart at each MCU row";
+				}
+				for (int i = 0; i < slices; ++i) {
+					int first = std::min(height, (i*nbBands/slices)*bandHeight);
+					int last = std::min(height, ((i+1)*nbBands/slices)*bandHeight);
+					Slice* slice = new Slice();
+					slice->m_line = first;
+					slice->m_height = last - first;
+					this->init(slice->m_cinfo, slice->m_jerr, slice->m_height, opt);
+					slice->m_cinfo.restart_interval = (width + 2*DCTSIZE - 1) / (2*DCTSIZE);
+					slice->m_jpegsize = width*slice->m_height*3/2;
+					slice->m_jpegbuffer = (unsigned char*)malloc(slice->m_jpegsize);
+					slice->m_length = 0;
+					m_slices.push_back(std::unique_ptr<Slice>(slice));
+				}
+				m_pool.reset(new WorkerPool(slices));
+				LOG(NOTICE) << "JPEG encoding in " << slices << " slices";
+			}
 		}
 
-		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) {
-				unsigned char * buffer_y = m_i420buffer;
-				unsigned char * buffer_u = buffer_y + m_width*m_height;
-				unsigned char * buffer_v = buffer_u + m_width*m_height/4;
-
-				libyuv::ConvertToI420((const uint8*)buffer, rsize,
-						buffer_y, m_width,
-						buffer_u, (m_width+1)/2,
-						buffer_v, (m_width+1)/2,
-						0, 0,
-						m_width, m_height,
-						m_width, m_height,
-						libyuv::kRotate0, format);
-
-				unsigned char* dest = NULL;
-				unsigned long  destsize = 0;
-				jpeg_mem_dest(&m_cinfo, &dest, &destsize);	
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
+				sink->setFrameInfo(this->takeFrameInfo());
+				uint64_t start = monotonicNow();
+				int ysize = m_width*m_height;
+				int cwidth = (m_width+1)/2;
+				int csize = cwidth*((m_height+1)/2);
+				const unsigned char * buffer_y = m_i420buffer;
+				const unsigned char * buffer_u = m_i420buffer + ysize;
+				const unsigned char * buffer_v = buffer_u + csize;
+				const unsigned char * data = (const unsigned char *)buffer;
 
-				jpeg_start_compress(&m_cinfo, TRUE);
+				if ( (format == V4L2_PIX_FMT_YUV420) && (rsize >= (unsigned int)(ysize+2*csize)) ) {
+					// read planes directly from the capture buffer
+					buffer_y = data;
+					buffer_u = data + ysize;
+					buffer_v = data + ysize + csize;
+				} else if ( (format == V4L2_PIX_FMT_YVU420) && (rsize >= (unsigned int)(ysize+2*csize)) ) {
+					buffer_y = data;
+					buffer_u = data + ysize + csize;
+					buffer_v = data + ysize;
+				} else if ( ((format == V4L2_PIX_FMT_NV12) || (format == V4L2_PIX_FMT_NV21)) && (rsize >= (unsigned int)(ysize+2*csize)) ) {
+					// luma in place, only split the chroma
+					buffer_y = data;
+					unsigned char * first  = m_i420buffer + ysize;
+					unsigned char * second = first + csize;
+					libyuv::SplitUVPlane(data + ysize, 2*cwidth,
+						first, cwidth,
+						second, cwidth,
+						cwidth, (m_height+1)/2);
+					if (format == V4L2_PIX_FMT_NV21) {
+						std::swap(buffer_u, buffer_v);
+					}
+				} else {
+					this->convertToI420(buffer, rsize, format, m_width, m_height,
+						m_i420buffer, m_width,
+						m_i420buffer + ysize, cwidth,
+						m_i420buffer + ysize + csize, cwidth);
+				}
+				m_convertTime = monotonicNow() - start;
 
-				unsigned char bufline[m_cinfo.image_width *  m_cinfo.num_components]; 
-				while (m_cinfo.next_scanline < m_cinfo.image_height) 
-				{ 
-					for (unsigned int i = 0; i < m_cinfo.image_width; ++i) 
-					{ 
-						bufline[i*3  ] = buffer_y[m_cinfo.next_scanline*m_cinfo.image_width + i]; 
-						bufline[i*3+1] = buffer_u[(m_cinfo.next_scanline*m_cinfo.image_width/2 + i)/2]; 
-						bufline[i*3+2] = buffer_v[(m_cinfo.next_scanline*m_cinfo.image_width/2 + i)/2];  
-					} 
-					JSAMPROW row = bufline; 
-					jpeg_write_scanlines(&m_cinfo, &row, 1); 
+				if (!m_slices.empty()) {
+					this->encodeSlices(buffer_y, buffer_u, buffer_v, cwidth, sink);
+					return;
 				}
-				jpeg_finish_compress(&m_cinfo);
+
+				unsigned char* dest = m_jpegbuffer;
+				unsigned long  destsize = m_jpegsize;
+				jpeg_mem_dest(&m_cinfo, &dest, &destsize);	
+
+				this->encodeRaw(m_cinfo, buffer_y, buffer_u, buffer_v, m_width, cwidth, m_height);
 						
-                int wsize = videoOutput->write((char *)dest,destsize);
+                int wsize = sink->write((char *)dest,destsize);
                 LOG(DEBUG) << "Copied size:" << wsize;
 
-				free(dest);										
+				if (dest != m_jpegbuffer) {
+					// libjpeg had to grow the buffer, keep the bigger one
+					free(m_jpegbuffer);
+					m_jpegbuffer = dest;
+					m_jpegsize = destsize;
+				}
 		}			
 						
 		~JpegEncoder() {
+				m_pool.reset();
+				for (std::unique_ptr<Slice> & slice : m_slices) {
+					jpeg_destroy_compress(&slice->m_cinfo);
+					free(slice->m_jpegbuffer);
+				}
 				jpeg_destroy_compress(&m_cinfo);
 				delete [] m_i420buffer;
+				free(m_jpegbuffer);
 		}				
 
+	private:
+		struct Slice {
+			struct jpeg_error_mgr m_jerr;
+			struct jpeg_compress_struct m_cinfo;
+			unsigned char * m_jpegbuffer;
+			unsigned long   m_jpegsize;
+			unsigned long   m_length;
+			int m_line;
+			int m_height;
+		};
+
+		void init(struct jpeg_compress_struct & cinfo, struct jpeg_error_mgr & jerr, int height, const std::map<std::string,std::string> & opt) {
+			cinfo.err = jpeg_std_error(&jerr);
+			jpeg_create_compress(&cinfo);
+			cinfo.image_width = m_width;
+			cinfo.image_height = height;
+			cinfo.input_components = 3;	
+			cinfo.in_color_space = JCS_YCbCr; 
+
+			jpeg_set_defaults(&cinfo);
+			std::map<std::string,std::string>::const_iterator quality = opt.find("QUALITY");
+			if (quality != opt.end()) {
+				int value = std::stoi(quality->second);
+				jpeg_set_quality(&cinfo, value, TRUE);
+			}
+			std::map<std::string,std::string>::const_iterator dri = opt.find("DRI");
+			if (dri != opt.end()) {
+				int value = std::stoi(dri->second);
+				cinfo.restart_interval = value;
+			}						
+
+			// feed the encoder with 4:2:0 planes, no resampling in libjpeg
+			cinfo.raw_data_in = TRUE;
+			cinfo.comp_info[0].h_samp_factor = 2;
+			cinfo.comp_info[0].v_samp_factor = 2;
+			cinfo.comp_info[1].h_samp_factor = 1;
+			cinfo.comp_info[1].v_samp_factor = 1;
+			cinfo.comp_info[2].h_samp_factor = 1;
+			cinfo.comp_info[2].v_samp_factor = 1;
+		}
+
+		// offset of the entropy coded data following the SOS header, 0 if not found
+		// the frame height of the SOF header is replaced when height is not 0
+		static unsigned long entropyOffset(unsigned char * data, unsigned long size, int height) {
+			unsigned long pos = 2;
+			while (pos + 4 <= size) {
+				if (data[pos] != 0xFF) {
+					return 0;
+				}
+				unsigned char marker = data[pos+1];
+				unsigned long length = (data[pos+2] << 8) | data[pos+3];
+				if ( (height != 0) && (marker >= 0xC0) && (marker <= 0xC2) && (pos + 7 <= size) ) {
+					data[pos+5] = height >> 8;
+					data[pos+6] = height & 0xFF;
+				}
+				pos += 2 + length;
+				if (marker == 0xDA) {
+					return pos;
+				}
+			}
+			return 0;
+		}
+
+		void encodeSlices(const unsigned char * y, const unsigned char * u, const unsigned char * v, int cwidth, FrameSink* sink) {
+				m_pool->run(m_slices.size(), [&](int index) {
+					Slice & slice = *m_slices[index];
+					unsigned char* dest = slice.m_jpegbuffer;
+					unsigned long  destsize = slice.m_jpegsize;
+					jpeg_mem_dest(&slice.m_cinfo, &dest, &destsize);
+
+					this->encodeRaw(slice.m_cinfo, y + slice.m_line*m_width, u + slice.m_line/2*cwidth, v + slice.m_line/2*cwidth, m_width, cwidth, slice.m_height);
+
+					if (dest != slice.m_jpegbuffer) {
+						free(slice.m_jpegbuffer);
+						slice.m_jpegbuffer = dest;
+						slice.m_jpegsize = destsize;
+					}
+					slice.m_length = destsize;
+				});
+
+				// headers of the first slice, then the entropy coded data of each slice
+				// separated by RST7 and terminated by EOI
+				static const unsigned char rst[2] = { 0xFF, 0xD7 };
+				static const unsigned char eoi[2] = { 0xFF, 0xD9 };
+				iovec iov[2*m_slices.size()];
+				int iovcnt = 0;
+				for (unsigned int i = 0; i < m_slices.size(); ++i) {
+					Slice & slice = *m_slices[i];
+					unsigned long offset = entropyOffset(slice.m_jpegbuffer, slice.m_length, (i == 0) ? m_height : 0);
+					if ( (offset == 0) || (slice.m_length < offset + 2) ) {
+						LOG(WARN) << "Cannot find entropy coded data of slice " << i;
+						return;
+					}
+					if (i == 0) {
+						offset = 0;
+					} else {
+						iov[iovcnt].iov_base = (void*)rst;
+						iov[iovcnt].iov_len = sizeof(rst);
+						iovcnt++;
+					}
+					iov[iovcnt].iov_base = slice.m_jpegbuffer + offset;
+					iov[iovcnt].iov_len = slice.m_length - 2 - offset;
+					iovcnt++;
+				}
+				iov[iovcnt].iov_base = (void*)eoi;
+				iov[iovcnt].iov_len = sizeof(eoi);
+				iovcnt++;
+
+				int wsize = sink->writev(iov, iovcnt);
+				LOG(DEBUG) << "Copied size:" << wsize;
+		}
+
+		// compress one MCU row (16 luma lines, 8 chroma lines) at a time
+		void encodeRaw(struct jpeg_compress_struct & cinfo, const unsigned char * y, const unsigned char * u, const unsigned char * v, int ystride, int cstride, int height) {
+				JSAMPROW yrows[2*DCTSIZE];
+				JSAMPROW urows[DCTSIZE];
+				JSAMPROW vrows[DCTSIZE];
+				JSAMPARRAY planes[3] = { yrows, urows, vrows };
+				int cheight = (height+1)/2;
+
+				jpeg_start_compress(&cinfo, TRUE);
+				while (cinfo.next_scanline < cinfo.image_height) 
+				{ 
+					int line = cinfo.next_scanline;
+					// repeat the last line to complete the bottom MCU row
+					for (int i = 0; i < 2*DCTSIZE; ++i) {
+						yrows[i] = (JSAMPROW)(y + std::min(line+i, height-1)*ystride);
+					}
+					for (int i = 0; i < DCTSIZE; ++i) {
+						int cline = std::min(line/2+i, cheight-1);
+						urows[i] = (JSAMPROW)(u + cline*cstride);
+						vrows[i] = (JSAMPROW)(v + cline*cstride);
+					}
+					jpeg_write_raw_data(&cinfo, planes, 2*DCTSIZE);
+				}
+				jpeg_finish_compress(&cinfo);
+		}
+
 	private:
 		struct jpeg_error_mgr m_jerr;
 		struct jpeg_compress_struct m_cinfo;	
 		unsigned char * m_i420buffer;
+		unsigned char * m_jpegbuffer;
+		unsigned long   m_jpegsize;
 		int m_width;
 		int m_height;
-};
\ No newline at end of file
+		std::vector<std::unique_ptr<Slice>> m_slices;
+		std::unique_ptr<WorkerPool>         m_pool;
+};
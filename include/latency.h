@@ -0,0 +1,223 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** latency.h
+**
+** Per stage latency histograms with a periodic summary
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "logger.h"
+
+// monotonic time in nanoseconds
+inline uint64_t monotonicNow() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* percentiles of a histogram, in milliseconds */
+struct LatencySummary {
+	LatencySummary() : m_count(0), m_p50(0), m_p90(0), m_p99(0), m_max(0) {}
+
+	uint64_t m_count;
+	double   m_p50;
+	double   m_p90;
+	double   m_p99;
+	double   m_max;
+};
+
+/* log-linear histogram of durations (32 buckets for each power of 2, 3% precision),
+   recording is lock free and can be done by several threads while it is read */
+class LatencyHistogram {
+	public:
+		enum { SUB_BITS = 5, SUB_COUNT = 1 << SUB_BITS, BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT };
+
+		LatencyHistogram(const std::string & name) : m_name(name), m_counts(BUCKETS), m_sum(0) {}
+
+		const std::string & getName() const { return m_name; }
+
+		void record(uint64_t ns) {
+			m_counts[index(ns)].fetch_add(1, std::memory_order_relaxed);
+			m_sum.fetch_add(ns, std::memory_order_relaxed);
+		}
+
+		// record the time elapsed since start, return the current time to chain the stages
+		uint64_t recordSince(uint64_t start) {
+			uint64_t now = monotonicNow();
+			this->record(now - start);
+			return now;
+		}
+
+		// copy of the counts, they only grow
+		void snapshot(std::vector<uint64_t> & counts) const {
+			counts.resize(BUCKETS);
+			for (int i = 0; i < BUCKETS; ++i) {
+				counts[i] = m_counts[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		uint64_t getSum() const { return m_sum.load(std::memory_order_relaxed); }
+
+		// percentiles of counts, the values are the middle of their bucket
+		static LatencySummary summarize(const std::vector<uint64_t> & counts) {
+			LatencySummary summary;
+			for (uint64_t count : counts) {
+				summary.m_count += count;
+			}
+			if (summary.m_count == 0) {
+				return summary;
+			}
+			uint64_t p50 = (summary.m_count*50 + 99)/100;
+			uint64_t p90 = (summary.m_count*90 + 99)/100;
+			uint64_t p99 = (summary.m_count*99 + 99)/100;
+			uint64_t seen = 0;
+			for (int i = 0; i < (int)counts.size(); ++i) {
+				if (counts[i] == 0) {
+					continue;
+				}
+				uint64_t before = seen;
+				seen += counts[i];
+				double value = middle(i) / 1e6;
+				if ( (before < p50) && (seen >= p50) ) summary.m_p50 = value;
+				if ( (before < p90) && (seen >= p90) ) summary.m_p90 = value;
+				if ( (before < p99) && (seen >= p99) ) summary.m_p99 = value;
+				summary.m_max = value;
+			}
+			return summary;
+		}
+
+		static int index(uint64_t value) {
+			if (value < 2*SUB_COUNT) {
+				return value;
+			}
+			int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+			return (shift+1)*SUB_COUNT + (value >> shift) - SUB_COUNT;
+		}
+
+		static uint64_t lowest(int index) {
+			if (index < 2*SUB_COUNT) {
+				return index;
+			}
+			int shift = index/SUB_COUNT - 1;
+			return (uint64_t)(index%SUB_COUNT + SUB_COUNT) << shift;
+		}
+
+		static uint64_t middle(int index) {
+			return (lowest(index) + lowest(index+1)) / 2;
+		}
+
+	private:
+		std::string                         m_name;
+		std::vector< std::atomic<uint64_t> > m_counts;
+		std::atomic<uint64_t>               m_sum;
+};
+
+/* the stages of a tool, with a thread printing the percentiles of the last period to the log or a file (every 10s by default) */
+class LatencyStats {
+	public:
+		LatencyStats(int period = 0, const std::string & filename = "") : m_period((period == 0 && !filename.empty()) ? 10 : period), m_filename(filename), m_frames(0), m_stop(false) {}
+
+		~LatencyStats() {
+			this->stop();
+		}
+
+		// declare a stage, before start
+		LatencyHistogram & add(const std::string & name) {
+			m_stages.push_back(std::unique_ptr<LatencyHistogram>(new LatencyHistogram(name)));
+			return *m_stages.back();
+		}
+
+		const std::vector< std::unique_ptr<LatencyHistogram> > & getStages() const { return m_stages; }
+
+		void frame() { m_frames.fetch_add(1, std::memory_order_relaxed); }
+		uint64_t getFrames() const { return m_frames.load(std::memory_order_relaxed); }
+
+		void start() {
+			if ( (m_period > 0) && !m_thread.joinable() ) {
+				if (!m_filename.empty()) {
+					m_file.open(m_filename.c_str(), std::ios::app);
+					if (!m_file.is_open()) {
+						LOG(WARN) << "Cannot open stats file:" << m_filename << " " << strerror(errno);
+					}
+				}
+				m_thread = std::thread(&LatencyStats::run, this);
+			}
+		}
+
+		void stop() {
+			if (m_thread.joinable()) {
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_stop = true;
+				}
+				m_cond.notify_all();
+				m_thread.join();
+			}
+		}
+
+	private:
+		void run() {
+			std::vector< std::vector<uint64_t> > last(m_stages.size(), std::vector<uint64_t>(LatencyHistogram::BUCKETS));
+			uint64_t lastFrames = this->getFrames();
+			uint64_t lastTime = monotonicNow();
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stop) {
+				m_cond.wait_for(lock, std::chrono::seconds(m_period));
+				uint64_t now = monotonicNow();
+				uint64_t frames = this->getFrames();
+				std::ostringstream os;
+				os << std::fixed << std::setprecision(2) << "fps:" << (frames - lastFrames)*1e9/std::max<uint64_t>(now - lastTime, 1);
+				std::vector<uint64_t> counts;
+				for (unsigned int i = 0; i < m_stages.size(); ++i) {
+					m_stages[i]->snapshot(counts);
+					std::vector<uint64_t> delta(counts);
+					for (unsigned int j = 0; j < delta.size(); ++j) {
+						delta[j] -= last[i][j];
+					}
+					last[i].swap(counts);
+					LatencySummary summary = LatencyHistogram::summarize(delta);
+					os << " " << m_stages[i]->getName() << "[ms] p50:" << summary.m_p50 << " p90:" << summary.m_p90 << " p99:" << summary.m_p99 << " max:" << summary.m_max;
+				}
+				lastFrames = frames;
+				lastTime = now;
+				if (m_file.is_open()) {
+					m_file << time(NULL) << " " << os.str() << std::endl;
+				} else {
+					LOG(NOTICE) << os.str();
+				}
+			}
+		}
+
+	private:
+		int                                              m_period;
+		std::string                                      m_filename;
+		std::vector< std::unique_ptr<LatencyHistogram> > m_stages;
+		std::atomic<uint64_t>                            m_frames;
+		std::ofstream                                    m_file;
+		bool                                             m_stop;
+		std::mutex                                       m_mutex;
+		std::condition_variable                          m_cond;
+		std::thread                                      m_thread;
+};
@@ -0,0 +1,353 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** metrics.h
+**
+** Frame counters exposed in Prometheus text format on a local HTTP listener
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <sstream>
+#include <iomanip>
+
+#include "logger.h"
+#include "latency.h"
+
+/* counters of a tool, the pipeline threads update them with relaxed atomics */
+class Metrics {
+	public:
+		Metrics(const LatencyStats* stats = NULL) : m_stats(stats), m_in(0), m_out(0), m_drops(0), m_bytes(0), m_lastTime(0), m_lastOut(0), m_lastBytes(0), m_fps(0), m_bitrate(0), m_interval(0) {}
+
+		// frames read from the capture device
+		void in(unsigned int count = 1) { m_in.fetch_add(count, std::memory_order_relaxed); }
+
+		// a frame written to the output device
+		void out(int bytes) {
+			m_out.fetch_add(1, std::memory_order_relaxed);
+			if (bytes > 0) {
+				m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+			}
+		}
+
+		// frames read but not written
+		void drop(unsigned int count = 1) { m_drops.fetch_add(count, std::memory_order_relaxed); }
+
+		// frame interval of the capture device, to compare with the jitter stage
+		void setFrameInterval(uint64_t ns) { m_interval.store(ns, std::memory_order_relaxed); }
+
+		uint64_t getDrops() const { return m_drops.load(std::memory_order_relaxed); }
+
+		// the result of a write, a failed one drops the frame
+		void written(int bytes) {
+			if (bytes > 0) {
+				this->out(bytes);
+			} else {
+				this->drop();
+			}
+		}
+
+		// a queue to report, size is called from the listener thread
+		void addQueue(const std::string & name, std::function<size_t()> size, size_t capacity) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queues.push_back(Queue(name, size, capacity));
+		}
+
+		// forget the queues, before they are destroyed
+		void removeQueues() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queues.clear();
+		}
+
+		// update the frame rate and the bitrate, at least one second apart
+		void sample() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			uint64_t now = monotonicNow();
+			uint64_t out = m_out.load(std::memory_order_relaxed);
+			uint64_t bytes = m_bytes.load(std::memory_order_relaxed);
+			if (m_lastTime == 0) {
+				m_lastTime = now;
+				m_lastOut = out;
+				m_lastBytes = bytes;
+			} else if (now - m_lastTime >= 1000000000ULL) {
+				m_fps = (out - m_lastOut)*1e9/(now - m_lastTime);
+				m_bitrate = (bytes - m_lastBytes)*8e9/(now - m_lastTime);
+				m_lastTime = now;
+				m_lastOut = out;
+				m_lastBytes = bytes;
+			}
+		}
+
+		// Prometheus text exposition format
+		std::string format() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::ostringstream os;
+			counter(os, "v4l2_frames_in_total", "Frames read from the capture device", m_in.load(std::memory_order_relaxed));
+			counter(os, "v4l2_frames_out_total", "Frames written to the output device", m_out.load(std::memory_order_relaxed));
+			counter(os, "v4l2_frames_dropped_total", "Frames read but not written", m_drops.load(std::memory_order_relaxed));
+			counter(os, "v4l2_bytes_out_total", "Bytes written to the output device", m_bytes.load(std::memory_order_relaxed));
+			os << std::fixed << std::setprecision(6);
+			os << "# HELP v4l2_fps Frames written during the last second\n# TYPE v4l2_fps gauge\nv4l2_fps " << m_fps << "\n";
+			os << "# HELP v4l2_bitrate_bits_per_second Bits written during the last second\n# TYPE v4l2_bitrate_bits_per_second gauge\nv4l2_bitrate_bits_per_second " << m_bitrate << "\n";
+
+			uint64_t interval = m_interval.load(std::memory_order_relaxed);
+			if (interval != 0) {
+				os << "# HELP v4l2_frame_interval_seconds Frame interval of the capture device\n# TYPE v4l2_frame_interval_seconds gauge\nv4l2_frame_interval_seconds " << interval/1e9 << "\n";
+			}
+
+			if (!m_queues.empty()) {
+				os << "# HELP v4l2_queue_frames Frames waiting in a queue\n# TYPE v4l2_queue_frames gauge\n";
+				for (const Queue & queue : m_queues) {
+					os << "v4l2_queue_frames{queue=\"" << queue.m_name << "\"} " << queue.m_size() << "\n";
+				}
+				os << "# HELP v4l2_queue_capacity Frames a queue can hold\n# TYPE v4l2_queue_capacity gauge\n";
+				for (const Queue & queue : m_queues) {
+					os << "v4l2_queue_capacity{queue=\"" << queue.m_name << "\"} " << queue.m_capacity << "\n";
+				}
+			}
+
+			if (m_stats && !m_stats->getStages().empty()) {
+				// percentiles since the start, the periodic log gives the recent ones
+				os << "# HELP v4l2_stage_seconds Duration of the stages of a frame\n# TYPE v4l2_stage_seconds summary\n";
+				std::vector<uint64_t> counts;
+				for (const std::unique_ptr<LatencyHistogram> & stage : m_stats->getStages()) {
+					stage->snapshot(counts);
+					LatencySummary summary = LatencyHistogram::summarize(counts);
+					const std::string & name = stage->getName();
+					os << "v4l2_stage_seconds{stage=\"" << name << "\",quantile=\"0.5\"} " << summary.m_p50/1000 << "\n";
+					os << "v4l2_stage_seconds{stage=\"" << name << "\",quantile=\"0.9\"} " << summary.m_p90/1000 << "\n";
+					os << "v4l2_stage_seconds{stage=\"" << name << "\",quantile=\"0.99\"} " << summary.m_p99/1000 << "\n";
+					os << "v4l2_stage_seconds_sum{stage=\"" << name << "\"} " << stage->getSum()/1e9 << "\n";
+					os << "v4l2_stage_seconds_count{stage=\"" << name << "\"} " << summary.m_count << "\n";
+				}
+			}
+			return os.str();
+		}
+
+	private:
+		static void counter(std::ostringstream & os, const char* name, const char* help, uint64_t value) {
+			os << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+		}
+
+		struct Queue {
+			Queue(const std::string & name, std::function<size_t()> size, size_t capacity) : m_name(name), m_size(size), m_capacity(capacity) {}
+			std::string              m_name;
+			std::function<size_t()>  m_size;
+			size_t                   m_capacity;
+		};
+
+	private:
+		const LatencyStats*   m_stats;
+		std::atomic<uint64_t> m_in;
+		std::atomic<uint64_t> m_out;
+		std::atomic<uint64_t> m_drops;
+		std::atomic<uint64_t> m_bytes;
+		std::mutex            m_mutex;
+		std::vector<Queue>    m_queues;
+		uint64_t              m_lastTime;
+		uint64_t              m_lastOut;
+		uint64_t              m_lastBytes;
+		double                m_fps;
+		double                m_bitrate;
+		std::atomic<uint64_t> m_interval;
+};
+
+/* answer every HTTP request with the metrics, on [host:]port (localhost by default) or unix:path */
+class MetricsServer {
+	public:
+		MetricsServer(Metrics & metrics, const std::string & address) : m_metrics(metrics), m_address(address), m_fd(-1) {
+			m_wakeup[0] = m_wakeup[1] = -1;
+		}
+
+		~MetricsServer() {
+			this->stop();
+		}
+
+		bool start() {
+			if (m_address.empty() || m_thread.joinable()) {
+				return false;
+			}
+			m_fd = this->listen();
+			if (m_fd == -1) {
+				return false;
+			}
+			if (pipe2(m_wakeup, O_CLOEXEC) != 0) {
+				LOG(WARN) << "Cannot create metrics pipe " << strerror(errno);
+				this->closeAll();
+				return false;
+			}
+			LOG(NOTICE) << "Metrics available on " << m_address;
+			m_thread = std::thread(&MetricsServer::run, this);
+			return true;
+		}
+
+		void stop() {
+			if (m_thread.joinable()) {
+				char c = 0;
+				if (::write(m_wakeup[1], &c, 1) != 1) {
+					LOG(WARN) << "Cannot wake up metrics thread " << strerror(errno);
+				}
+				m_thread.join();
+			}
+			this->closeAll();
+		}
+
+	private:
+		int listen() {
+			int fd = -1;
+			if (m_address.compare(0, 5, "unix:") == 0) {
+				std::string path = m_address.substr(5);
+				sockaddr_un addr;
+				memset(&addr, 0, sizeof(addr));
+				addr.sun_family = AF_UNIX;
+				if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+					LOG(WARN) << "Cannot use metrics socket path:" << path;
+					return -1;
+				}
+				strcpy(addr.sun_path, path.c_str());
+				unlink(path.c_str());
+				fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				if ( (fd != -1) && (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) ) {
+					LOG(WARN) << "Cannot bind metrics socket:" << path << " " << strerror(errno);
+					close(fd);
+					return -1;
+				}
+				m_path = path;
+			} else {
+				std::string host = "127.0.0.1";
+				std::string port = m_address;
+				size_t pos = m_address.rfind(':');
+				if (pos != std::string::npos) {
+					host = m_address.substr(0, pos);
+					port = m_address.substr(pos+1);
+				}
+				sockaddr_in addr;
+				memset(&addr, 0, sizeof(addr));
+				addr.sin_family = AF_INET;
+				addr.sin_port = htons(atoi(port.c_str()));
+				if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+					LOG(WARN) << "Cannot parse metrics address:" << m_address;
+					return -1;
+				}
+				fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				int on = 1;
+				if (fd != -1) {
+					setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+				}
+				if ( (fd != -1) && (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) ) {
+					LOG(WARN) << "Cannot bind metrics address:" << m_address << " " << strerror(errno);
+					close(fd);
+					return -1;
+				}
+			}
+			if (fd == -1) {
+				LOG(WARN) << "Cannot create metrics socket " << strerror(errno);
+			} else if (::listen(fd, 4) != 0) {
+				LOG(WARN) << "Cannot listen metrics socket " << strerror(errno);
+				close(fd);
+				fd = -1;
+			}
+			return fd;
+		}
+
+		void run() {
+			pollfd fds[2];
+			fds[0].fd = m_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = m_wakeup[0];
+			fds[1].events = POLLIN;
+			for (;;) {
+				m_metrics.sample();
+				fds[0].revents = fds[1].revents = 0;
+				int ret = poll(fds, 2, 1000);
+				if ( (ret == -1) && (errno != EINTR) ) {
+					LOG(WARN) << "Metrics poll error " << strerror(errno);
+					break;
+				}
+				if (fds[1].revents) {
+					break;
+				}
+				if (fds[0].revents & POLLIN) {
+					int fd = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC);
+					if (fd != -1) {
+						this->answer(fd);
+						close(fd);
+					}
+				}
+			}
+		}
+
+		// the request is read and ignored, a slow client is not waited for long
+		void answer(int fd) {
+			pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 200) == 1) {
+				char request[1024];
+				if (recv(fd, request, sizeof(request), 0) < 0) {
+					return;
+				}
+			}
+			std::string body = m_metrics.format();
+			std::ostringstream os;
+			os << "HTTP/1.0 200 OK\r\n";
+			os << "Content-Type: text/plain; version=0.0.4\r\n";
+			os << "Content-Length: " << body.size() << "\r\n";
+			os << "Connection: close\r\n\r\n";
+			os << body;
+			std::string response = os.str();
+			size_t sent = 0;
+			while (sent < response.size()) {
+				ssize_t ret = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+				if (ret <= 0) {
+					break;
+				}
+				sent += ret;
+			}
+		}
+
+		void closeAll() {
+			if (m_fd != -1) {
+				close(m_fd);
+				m_fd = -1;
+			}
+			for (int i = 0; i < 2; ++i) {
+				if (m_wakeup[i] != -1) {
+					close(m_wakeup[i]);
+					m_wakeup[i] = -1;
+				}
+			}
+			if (!m_path.empty()) {
+				unlink(m_path.c_str());
+				m_path.clear();
+			}
+		}
+
+	private:
+		Metrics &     m_metrics;
+		std::string   m_address;
+		std::string   m_path;
+		int           m_fd;
+		int           m_wakeup[2];
+		std::thread   m_thread;
+};
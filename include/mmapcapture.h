@@ -0,0 +1,144 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** mmapcapture.h
+** 
+** Access in place to the memory mapped buffers of a V4L2 capture device
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include <vector>
+
+#include "logger.h"
+#include "V4l2Capture.h"
+#include "frameinfo.h"
+
+/* a dequeued capture buffer, valid until it is requeued */
+struct CaptureBuffer {
+	CaptureBuffer() : m_index(-1), m_data(NULL), m_size(0) {}
+
+	int          m_index;
+	const char*  m_data;
+	unsigned int m_size;
+	FrameInfo    m_info;
+};
+
+class MmapCapture {
+	public:
+		// map the buffers allocated by the V4L2 capture, not ready if it does not use memory mapped buffers
+		MmapCapture(V4l2Capture* videoCapture) : m_fd(videoCapture->getFd()) {
+			for (unsigned int index = 0; ; ++index) {
+				struct v4l2_buffer buf;
+				memset(&buf, 0, sizeof(buf));
+				buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+				buf.memory = V4L2_MEMORY_MMAP;
+				buf.index  = index;
+				if (ioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+					break;
+				}
+				void* start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, m_fd, buf.m.offset);
+				if (start == MAP_FAILED) {
+					LOG(WARN) << "Cannot map buffer:" << index << " " << strerror(errno);
+					this->unmap();
+					break;
+				}
+				m_buffers.push_back(Mapping(start, buf.length));
+			}
+			LOG(INFO) << "Mapped " << m_buffers.size() << " capture buffers";
+		}
+
+		~MmapCapture() {
+			this->unmap();
+		}
+
+		bool isReady() const { return !m_buffers.empty(); }
+		unsigned int getBufferCount() const { return m_buffers.size(); }
+
+		// dequeue a filled buffer, return its size or -1 with errno set, EAGAIN when none is ready yet
+		int dequeue(CaptureBuffer & buffer) {
+			struct v4l2_buffer buf;
+			memset(&buf, 0, sizeof(buf));
+			buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+				int err = errno;
+				if (err != EAGAIN) {
+					LOG(WARN) << "VIDIOC_DQBUF " << strerror(err);
+				}
+				errno = err;
+				return -1;
+			}
+			if (buf.index >= m_buffers.size()) {
+				LOG(WARN) << "VIDIOC_DQBUF unexpected index:" << buf.index;
+				errno = EINVAL;
+				return -1;
+			}
+			buffer.m_index = buf.index;
+			buffer.m_data  = (const char*)m_buffers[buf.index].m_start;
+			buffer.m_size  = buf.bytesused;
+			buffer.m_info  = FrameInfo(buf.timestamp, buf.sequence);
+			return buf.bytesused;
+		}
+
+		// dequeue all the filled buffers and keep the newest, the older ones are given back to the driver
+		// and added to dropped, return the size of the newest or -1 with errno set like dequeue
+		int dequeueLatest(CaptureBuffer & buffer, unsigned int & dropped) {
+			int size = this->dequeue(buffer);
+			for (unsigned int i = 0; (size != -1) && (i < m_buffers.size()); ++i) {
+				CaptureBuffer newer;
+				int newerSize = this->dequeue(newer);
+				if (newerSize == -1) {
+					break;
+				}
+				this->requeue(buffer);
+				dropped++;
+				buffer = newer;
+				size = newerSize;
+			}
+			return size;
+		}
+
+		// give the buffer back to the driver
+		bool requeue(CaptureBuffer & buffer) {
+			struct v4l2_buffer buf;
+			memset(&buf, 0, sizeof(buf));
+			buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index  = buffer.m_index;
+			if (ioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+				LOG(WARN) << "VIDIOC_QBUF " << strerror(errno);
+				return false;
+			}
+			buffer.m_index = -1;
+			buffer.m_data  = NULL;
+			return true;
+		}
+
+	private:
+		void unmap() {
+			for (Mapping & mapping : m_buffers) {
+				munmap(mapping.m_start, mapping.m_length);
+			}
+			m_buffers.clear();
+		}
+
+		struct Mapping {
+			Mapping(void* start, size_t length) : m_start(start), m_length(length) {}
+			void*  m_start;
+			size_t m_length;
+		};
+
+	private:
+		int                  m_fd;
+		std::vector<Mapping> m_buffers;
+};
@@ -0,0 +1,110 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** mmapoutput.h
+** 
+** Write to the memory mapped buffers of a V4L2 output device with the capture timestamp
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/videodev2.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "logger.h"
+#include "V4l2Output.h"
+#include "frameinfo.h"
+
+class MmapOutput {
+	public:
+		// map the buffers allocated by the V4L2 output, not ready if it does not use memory mapped buffers
+		MmapOutput(V4l2Output* videoOutput) : m_fd(videoOutput->getFd()) {
+			for (unsigned int index = 0; ; ++index) {
+				struct v4l2_buffer buf;
+				memset(&buf, 0, sizeof(buf));
+				buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+				buf.memory = V4L2_MEMORY_MMAP;
+				buf.index  = index;
+				if (ioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+					break;
+				}
+				void* start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, buf.m.offset);
+				if (start == MAP_FAILED) {
+					LOG(WARN) << "Cannot map output buffer:" << index << " " << strerror(errno);
+					this->unmap();
+					break;
+				}
+				m_buffers.push_back(Mapping(start, buf.length));
+			}
+			LOG(INFO) << "Mapped " << m_buffers.size() << " output buffers";
+		}
+
+		~MmapOutput() {
+			this->unmap();
+		}
+
+		bool isReady() const { return !m_buffers.empty(); }
+
+		// copy the parts of a frame in a free buffer and queue it with the timestamp of the frame, return the size or -1
+		int write(const struct iovec* iov, int iovcnt, const FrameInfo & info) {
+			struct v4l2_buffer buf;
+			memset(&buf, 0, sizeof(buf));
+			buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+				LOG(WARN) << "VIDIOC_DQBUF " << strerror(errno);
+				return -1;
+			}
+			if (buf.index >= m_buffers.size()) {
+				LOG(WARN) << "VIDIOC_DQBUF unexpected index:" << buf.index;
+				return -1;
+			}
+			Mapping & mapping = m_buffers[buf.index];
+			size_t size = 0;
+			for (int i = 0; i < iovcnt; ++i) {
+				size_t length = std::min(iov[i].iov_len, mapping.m_length - size);
+				if (length < iov[i].iov_len) {
+					LOG(WARN) << "Frame truncated to the output buffer size:" << mapping.m_length;
+				}
+				memcpy((char*)mapping.m_start + size, iov[i].iov_base, length);
+				size += length;
+			}
+			buf.bytesused = size;
+			buf.flags    |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+			buf.timestamp = info.getTimeval();
+			buf.sequence  = info.m_sequence;
+			if (ioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+				LOG(WARN) << "VIDIOC_QBUF " << strerror(errno);
+				return -1;
+			}
+			return size;
+		}
+
+	private:
+		void unmap() {
+			for (Mapping & mapping : m_buffers) {
+				munmap(mapping.m_start, mapping.m_length);
+			}
+			m_buffers.clear();
+		}
+
+		struct Mapping {
+			Mapping(void* start, size_t length) : m_start(start), m_length(length) {}
+			void*  m_start;
+			size_t m_length;
+		};
+
+	private:
+		int                  m_fd;
+		std::vector<Mapping> m_buffers;
+};
@@ -0,0 +1,163 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** realtime.h
+**
+** Real-time scheduling, CPU pinning and memory locking of the threads
+** handling the frames, and their wakeup jitter against the frame interval
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <sched.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include <map>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include "logger.h"
+#include "affinity.h"
+#include "latency.h"
+
+class Realtime {
+	public:
+		Realtime() : m_policy(SCHED_OTHER), m_priority(0), m_lockMemory(false) {}
+
+		// parse fifo[:priority] or rr[:priority], the priority is 1 by default
+		bool parsePolicy(const std::string & spec) {
+			size_t pos = spec.find(':');
+			std::string name = spec.substr(0, pos);
+			int priority = (pos == std::string::npos) ? 1 : atoi(spec.substr(pos+1).c_str());
+			int policy = 0;
+			if (name == "fifo") {
+				policy = SCHED_FIFO;
+			} else if (name == "rr") {
+				policy = SCHED_RR;
+			} else {
+				return false;
+			}
+			if ( (priority < sched_get_priority_min(policy)) || (priority > sched_get_priority_max(policy)) ) {
+				return false;
+			}
+			m_policy = policy;
+			m_priority = priority;
+			return true;
+		}
+
+		// parse a CPU list for all the threads (0,2-3), or one per role (capture=0:encode=1-3:output=0)
+		bool parseAffinity(const std::string & spec) {
+			cpu_set_t set;
+			if (spec.find('=') == std::string::npos) {
+				if (!parseCpuList(spec, set)) {
+					return false;
+				}
+				m_cpus[""] = spec;
+				return true;
+			}
+			std::istringstream is(spec);
+			std::string item;
+			while (std::getline(is, item, ':')) {
+				size_t pos = item.find('=');
+				if (pos == std::string::npos) {
+					return false;
+				}
+				std::string role = item.substr(0, pos);
+				std::string list = item.substr(pos+1);
+				if ( ((role != "capture") && (role != "encode") && (role != "output")) || !parseCpuList(list, set) ) {
+					return false;
+				}
+				m_cpus[role] = list;
+			}
+			return true;
+		}
+
+		void setLockMemory(bool lockMemory) { m_lockMemory = lockMemory; }
+
+		// lock the pages of the process, and the ones it maps later, to avoid page faults in the frame loops
+		bool lockMemory() const {
+			if (m_lockMemory && (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)) {
+				LOG(WARN) << "Cannot lock memory " << strerror(errno) << " (check RLIMIT_MEMLOCK)";
+				return false;
+			}
+			return true;
+		}
+
+		// apply the policy and the CPU list of a role to the calling thread, the threads it creates later inherit them
+		bool apply(const std::string & role) const {
+			bool ret = true;
+			std::map<std::string,std::string>::const_iterator it = m_cpus.find(role);
+			if (it == m_cpus.end()) {
+				it = m_cpus.find("");
+			}
+			if (it != m_cpus.end()) {
+				ret = setThreadAffinity(it->second);
+			}
+			if (m_policy != SCHED_OTHER) {
+				struct sched_param param;
+				memset(&param, 0, sizeof(param));
+				param.sched_priority = m_priority;
+				int err = pthread_setschedparam(pthread_self(), m_policy, &param);
+				if (err != 0) {
+					LOG(WARN) << "Cannot set " << role << " thread to " << ((m_policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR") << " priority " << m_priority << " " << strerror(err) << " (needs CAP_SYS_NICE or RLIMIT_RTPRIO)";
+					ret = false;
+				}
+			}
+			LOG(INFO) << role << " thread policy:" << m_policy << " priority:" << m_priority << " cpu:" << ((it != m_cpus.end()) ? it->second : "any");
+			return ret;
+		}
+
+	private:
+		int                                m_policy;
+		int                                m_priority;
+		bool                               m_lockMemory;
+		std::map<std::string,std::string>  m_cpus;
+};
+
+// frame interval of a capture device in nanoseconds, 0 when the driver does not tell it
+inline uint64_t frameInterval(int fd) {
+	struct v4l2_streamparm parm;
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if ( (ioctl(fd, VIDIOC_G_PARM, &parm) != 0) || (parm.parm.capture.timeperframe.denominator == 0) ) {
+		return 0;
+	}
+	return parm.parm.capture.timeperframe.numerator*1000000000ULL/parm.parm.capture.timeperframe.denominator;
+}
+
+/* distance of the wakeups of a thread to the frame interval, a frame dropped by the driver is a whole interval,
+   without interval the distance to the previous period is recorded */
+class JitterMeter {
+	public:
+		JitterMeter(LatencyHistogram & histogram, uint64_t interval) : m_histogram(histogram), m_interval(interval), m_last(0), m_lastPeriod(0) {}
+
+		void tick(uint64_t now) {
+			if (m_last != 0) {
+				uint64_t period = now - m_last;
+				if (m_interval != 0) {
+					uint64_t offset = period % m_interval;
+					m_histogram.record((period < m_interval) ? m_interval - period : std::min(offset, m_interval - offset));
+				} else if (m_lastPeriod != 0) {
+					m_histogram.record((period > m_lastPeriod) ? period - m_lastPeriod : m_lastPeriod - period);
+				}
+				m_lastPeriod = period;
+			}
+			m_last = now;
+		}
+
+	private:
+		LatencyHistogram & m_histogram;
+		uint64_t           m_interval;
+		uint64_t           m_last;
+		uint64_t           m_lastPeriod;
+};
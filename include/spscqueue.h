@@ -0,0 +1,78 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** spscqueue.h
+** 
+** Bounded lock-free single producer/single consumer queue of preallocated slots
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+// wait a little when a queue is full or empty
+inline void waitQueue() {
+	std::this_thread::sleep_for(std::chrono::microseconds(500));
+}
+
+template <typename T>
+class SpscQueue {
+	public:
+		SpscQueue(size_t size) : m_slots(size+1), m_head(0), m_tail(0) {}
+
+		// producer : get the free slot to fill, NULL if the queue is full
+		T* back() {
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (next(tail) == m_head.load(std::memory_order_acquire)) {
+				return NULL;
+			}
+			return &m_slots[tail];
+		}
+
+		// producer : publish the slot returned by back()
+		void push() {
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			m_tail.store(next(tail), std::memory_order_release);
+		}
+
+		// consumer : get the oldest published slot, NULL if the queue is empty
+		T* front() {
+			size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire)) {
+				return NULL;
+			}
+			return &m_slots[head];
+		}
+
+		// consumer : release the slot returned by front()
+		void pop() {
+			size_t head = m_head.load(std::memory_order_relaxed);
+			m_head.store(next(head), std::memory_order_release);
+		}
+
+		size_t size() const {
+			size_t head = m_head.load(std::memory_order_acquire);
+			size_t tail = m_tail.load(std::memory_order_acquire);
+			return (tail + m_slots.size() - head) % m_slots.size();
+		}
+
+		size_t capacity() const { return m_slots.size()-1; }
+
+		// access to all the slots, to preallocate them
+		std::vector<T> & slots() { return m_slots; }
+
+	private:
+		size_t next(size_t index) const { return (index+1) % m_slots.size(); }
+
+	private:
+		std::vector<T>      m_slots;
+		std::atomic<size_t> m_head;
+		char                m_pad[64];
+		std::atomic<size_t> m_tail;
+};
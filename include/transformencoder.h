@@ -0,0 +1,59 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** transformencoder.h
+** 
+** Crop, flip and rotate the captured frames before an other encoder
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <vector>
+
+#include "encoder.h"
+#include "yuvconverter.h"
+
+class TransformEncoder : public Encoder {
+	public:
+		// take the ownership of the encoder, created with the transformed size
+		TransformEncoder(Encoder* encoder, int format, int width, int height, const YuvTransform & transform, int stripes)
+			: m_encoder(encoder)
+			, m_converter(format, V4L2_PIX_FMT_YUV420, width, height, 0, 0, libyuv::kFilterBox, transform) {
+			m_converter.setStripes(stripes);
+			YuvImage image;
+			m_buffer.resize(YuvConverter::layout(V4L2_PIX_FMT_YUV420, m_converter.getOutputWidth(), m_converter.getOutputHeight(), NULL, image));
+		}
+
+		~TransformEncoder() {
+			delete m_encoder;
+		}
+
+		// the encoder reads the transformed I420 frame in place
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
+			if (format != m_converter.getInputFormat()) {
+				LOG(WARN) << "Unexpected format:" << V4l2Device::fourcc(format);
+				return;
+			}
+			uint64_t start = monotonicNow();
+			int size = m_converter.convert(buffer, rsize, m_buffer.data(), m_buffer.size());
+			m_convertTime = monotonicNow() - start;
+			m_encoder->setFrameInfo(m_info);
+			m_info = FrameInfo();
+			if (size > 0) {
+				m_encoder->convertEncodeWrite(m_buffer.data(), size, V4L2_PIX_FMT_YUV420, sink);
+				m_convertTime += m_encoder->getConvertTime();
+			}
+		}
+
+		void flush(FrameSink* sink) {
+			m_encoder->flush(sink);
+		}
+
+	private:
+		Encoder*           m_encoder;
+		YuvConverter       m_converter;
+		std::vector<char>  m_buffer;
+};
@@ -0,0 +1,108 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** turbojpegencoder.h
+** 
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "libyuv.h"
+#include "logger.h"
+#include "encoder.h"
+
+#include <turbojpeg.h>
+
+class TurboJpegEncoder : public Encoder {
+	public:
+		TurboJpegEncoder(int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
+			: m_handle(tjInitCompress())
+			, m_quality(75)
+			, m_width(width)
+			, m_height(height) {	
+
+			std::map<std::string,std::string>::const_iterator quality = opt.find("QUALITY");
+			if (quality != opt.end()) {
+				m_quality = std::stoi(quality->second);
+			}
+			if (opt.find("DRI") != opt.end()) {
+				LOG(WARN) << "restart interval is not supported by TurboJPEG"; 
+			}
+			std::map<std::string,std::string>::const_iterator slices = opt.find("SLICES");
+			if ( (slices != opt.end()) && (std::stoi(slices->second) > 1) ) {
+				LOG(WARN) << "slices are not supported by TurboJPEG, the frame is encoded by one thread"; 
+			}
+
+			// large enough for planar 4:2:0 or 4:2:2
+			m_yuvbuffer = new unsigned char [width*height*2];
+			m_jpegsize = tjBufSize(width, height, TJSAMP_422);
+			m_jpegbuffer = tjAlloc(m_jpegsize);
+		}
+
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
+				sink->setFrameInfo(this->takeFrameInfo());
+				uint64_t start = monotonicNow();
+				int ysize = m_width*m_height;
+				int cwidth = (m_width+1)/2;
+				int cheight = (m_height+1)/2;
+				int subsamp = TJSAMP_420;
+				const unsigned char * data = (const unsigned char *)buffer;
+				const unsigned char * planes[3] = { m_yuvbuffer, m_yuvbuffer + ysize, m_yuvbuffer + ysize + cwidth*cheight };
+
+				if ( (format == V4L2_PIX_FMT_YUV420) && (rsize >= (unsigned int)(ysize+2*cwidth*cheight)) ) {
+					// read planes directly from the capture buffer
+					planes[0] = data;
+					planes[1] = data + ysize;
+					planes[2] = data + ysize + cwidth*cheight;
+				} else if ( (format == V4L2_PIX_FMT_YUV422P) && (rsize >= (unsigned int)(ysize+2*cwidth*m_height)) ) {
+					subsamp = TJSAMP_422;
+					planes[0] = data;
+					planes[1] = data + ysize;
+					planes[2] = data + ysize + cwidth*m_height;
+				} else if ( (format == V4L2_PIX_FMT_YUYV) || (format == V4L2_PIX_FMT_UYVY) ) {
+					// keep the 4:2:2 chroma
+					subsamp = TJSAMP_422;
+					unsigned char * u = m_yuvbuffer + ysize;
+					unsigned char * v = u + cwidth*m_height;
+					planes[1] = u;
+					planes[2] = v;
+					if (format == V4L2_PIX_FMT_YUYV) {
+						libyuv::YUY2ToI422(data, m_width*2, m_yuvbuffer, m_width, u, cwidth, v, cwidth, m_width, m_height);
+					} else {
+						libyuv::UYVYToI422(data, m_width*2, m_yuvbuffer, m_width, u, cwidth, v, cwidth, m_width, m_height);
+					}
+				} else {
+					this->convertToI420(buffer, rsize, format, m_width, m_height,
+						m_yuvbuffer, m_width,
+						m_yuvbuffer + ysize, cwidth,
+						m_yuvbuffer + ysize + cwidth*cheight, cwidth);
+				}
+				m_convertTime = monotonicNow() - start;
+
+				int strides[3] = { m_width, cwidth, cwidth };
+				unsigned long jpegsize = m_jpegsize;
+				if (tjCompressFromYUVPlanes(m_handle, planes, m_width, strides, m_height, subsamp, &m_jpegbuffer, &jpegsize, m_quality, TJFLAG_NOREALLOC) != 0) {
+					LOG(WARN) << "tjCompressFromYUVPlanes " << tjGetErrorStr(); 
+				} else {
+					int wsize = sink->write((char *)m_jpegbuffer, jpegsize);
+					LOG(DEBUG) << "Copied size:" << wsize;
+				}
+		}			
+						
+		~TurboJpegEncoder() {
+				tjDestroy(m_handle);
+				tjFree(m_jpegbuffer);
+				delete [] m_yuvbuffer;
+		}				
+
+	private:
+		tjhandle        m_handle;
+		int             m_quality;
+		unsigned char * m_yuvbuffer;
+		unsigned char * m_jpegbuffer;
+		unsigned long   m_jpegsize;
+		int m_width;
+		int m_height;
+};
@@ -26,7 +26,7 @@ class VpxEncoder : public Encoder {
 		VpxEncoder(int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
 			: m_width(width)
 			, m_height(height)
-            , m_frame_cnt(0) {
+            , m_duration(0) {
 
 
 			if(!vpx_img_alloc(&m_input, VPX_IMG_FMT_I420, width, height, 1))
@@ -44,6 +44,13 @@ class VpxEncoder : public Encoder {
 			cfg.g_w = width;
 			cfg.g_h = height;	
 
+			// pts are the capture times in microseconds, the rate control uses the frame duration
+			int fpsNum = 25, fpsDen = 1;
+			getFrameRate(opt, fpsNum, fpsDen);
+			cfg.g_timebase.num = 1;
+			cfg.g_timebase.den = 1000000;
+			m_duration = 1000000ULL*fpsDen/fpsNum;
+
 			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
 			if (keyint != opt.end()) {
 				int value = std::stoi(keyint->second);	
@@ -51,13 +58,13 @@ class VpxEncoder : public Encoder {
 				cfg.kf_max_dist = value;						
 			}
 
+			// a CBR bitrate wins over the default VBR one
 			std::map<std::string,std::string>::const_iterator cbr = opt.find("CBR");
+			std::map<std::string,std::string>::const_iterator vbr = opt.find("VBR");
 			if (cbr != opt.end()) {
                 cfg.rc_end_usage = VPX_CBR;
                 cfg.rc_target_bitrate = std::stoi(cbr->second);
-            }            
-			std::map<std::string,std::string>::const_iterator vbr = opt.find("VBR");
-			if (cbr != opt.end()) {
+            } else if (vbr != opt.end()) {
                 cfg.rc_end_usage = VPX_VBR;
                 cfg.rc_target_bitrate = std::stoi(vbr->second);
             }   			
@@ -79,19 +86,24 @@ class VpxEncoder : public Encoder {
             return algo;
         }        
 
-		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) {
-
-                libyuv::ConvertToI420((const uint8*)buffer, rsize,
-                    m_input.planes[0], m_width,
-                    m_input.planes[1], (m_width+1)/2,
-                    m_input.planes[2], (m_width+1)/2,
-                    0, 0,
-                    m_width, m_height,
-                    m_width, m_height,
-                    libyuv::kRotate0, format);
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
+
+                uint64_t start = monotonicNow();
+                vpx_image_t* input = &m_input;
+                unsigned int i420size = m_width*m_height + 2*((m_width+1)/2)*((m_height+1)/2);
+                if ( (format == V4L2_PIX_FMT_YUV420) && (rsize >= i420size) ) {
+                    // encode directly from the capture buffer
+                    input = vpx_img_wrap(&m_wrap, VPX_IMG_FMT_I420, m_width, m_height, 1, (unsigned char*)buffer);
+                } else {
+                    this->convertToI420(buffer, rsize, format, m_width, m_height,
+                        m_input.planes[0], m_width,
+                        m_input.planes[1], (m_width+1)/2,
+                        m_input.planes[2], (m_width+1)/2);
+                }
+                m_convertTime = monotonicNow() - start;
 
                 int flags=0;          
-                if(vpx_codec_encode(&m_codec, &m_input, m_frame_cnt++ , 1, flags, VPX_DL_REALTIME))    
+                if(vpx_codec_encode(&m_codec, input, this->pushFrameInfo(), m_duration, flags, VPX_DL_REALTIME))    
                 {					
                     LOG(WARN) << "vpx_codec_encode: " << vpx_codec_error(&m_codec) << "(" << vpx_codec_error_detail(&m_codec) << ")";
                 }
@@ -102,7 +114,8 @@ class VpxEncoder : public Encoder {
                 {
                     if (pkt->kind==VPX_CODEC_CX_FRAME_PKT)
                     {
-                        int wsize = videoOutput->write((char*)pkt->data.frame.buf, pkt->data.frame.sz);
+                        sink->setFrameInfo(this->popFrameInfo(pkt->data.frame.pts));
+                        int wsize = sink->write((char*)pkt->data.frame.buf, pkt->data.frame.sz);
                         LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
                     }
                     else
@@ -119,7 +132,8 @@ class VpxEncoder : public Encoder {
 	private:
 		vpx_codec_ctx_t m_codec;
         vpx_image_t     m_input;
+        vpx_image_t     m_wrap;
 		int m_width;
 		int m_height;
-        int m_frame_cnt;
+        unsigned long m_duration;
 };
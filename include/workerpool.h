@@ -0,0 +1,115 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** workerpool.h
+** 
+** Pool of threads reused to run the parts of a job in parallel
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+class WorkerPool {
+	public:
+		// the calling thread is one of the workers
+		WorkerPool(int threads) : m_task(NULL), m_count(0), m_next(0), m_done(0), m_generation(0), m_stop(false) {
+			for (int i = 1; i < threads; ++i) {
+				m_threads.push_back(std::thread(&WorkerPool::loop, this));
+			}
+		}
+
+		~WorkerPool() {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_cond.notify_all();
+			for (std::thread & thread : m_threads) {
+				thread.join();
+			}
+		}
+
+		int size() const { return m_threads.size()+1; }
+
+		// run task(0) .. task(count-1) on the pool and wait until all are done
+		void run(int count, const std::function<void(int)> & task) {
+			if (m_threads.empty()) {
+				for (int i = 0; i < count; ++i) {
+					task(i);
+				}
+				return;
+			}
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_task = &task;
+				m_count = count;
+				m_next = 0;
+				m_done = 0;
+				m_generation++;
+			}
+			m_cond.notify_all();
+			this->work();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_doneCond.wait(lock, [this]() { return m_done == m_count; });
+			m_task = NULL;
+		}
+
+	private:
+		void work() {
+			while (true) {
+				int index = 0;
+				const std::function<void(int)> * task = NULL;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_next >= m_count) {
+						return;
+					}
+					index = m_next++;
+					task = m_task;
+				}
+				(*task)(index);
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (++m_done == m_count) {
+						m_doneCond.notify_all();
+					}
+				}
+			}
+		}
+
+		void loop() {
+			unsigned long generation = 0;
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_cond.wait(lock, [&]() { return m_stop || (m_generation != generation); });
+					if (m_stop) {
+						return;
+					}
+					generation = m_generation;
+				}
+				this->work();
+			}
+		}
+
+	private:
+		std::vector<std::thread>          m_threads;
+		std::mutex                        m_mutex;
+		std::condition_variable           m_cond;
+		std::condition_variable           m_doneCond;
+		const std::function<void(int)> *  m_task;
+		int                               m_count;
+		int                               m_next;
+		int                               m_done;
+		unsigned long                     m_generation;
+		bool                              m_stop;
+};
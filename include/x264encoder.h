@@ -26,104 +26,271 @@ class X264Encoder : public Encoder {
 	public:
 		X264Encoder(int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
 			: m_encoder(NULL)
+			, m_informat(0)
 			, m_width(width)
 			, m_height(height) {
 
-			x264_param_t param;
-			x264_param_default_preset(&param, "ultrafast", "zerolatency");
+			std::string preset = "ultrafast";
+			std::map<std::string,std::string>::const_iterator presetIt = opt.find("PRESET");
+			if (presetIt != opt.end()) {
+				preset = presetIt->second;
+			}
+			std::string tune = "zerolatency";
+			std::map<std::string,std::string>::const_iterator tuneIt = opt.find("TUNE");
+			if (tuneIt != opt.end()) {
+				tune = tuneIt->second;
+			}
+			if (x264_param_default_preset(&m_param, preset.c_str(), tune.c_str()) < 0) {
+				LOG(WARN) << "Unknown x264 preset:" << preset << " tune:" << tune; 
+				x264_param_default_preset(&m_param, "ultrafast", "zerolatency");
+			}
 			if (verbose>1)
 			{
-				param.i_log_level = X264_LOG_DEBUG;
+				m_param.i_log_level = X264_LOG_DEBUG;
+			}
+			m_param.i_threads = 1;
+			std::map<std::string,std::string>::const_iterator threads = opt.find("THREADS");
+			if (threads != opt.end()) {
+				m_param.i_threads = std::stoi(threads->second);
+			}
+			std::map<std::string,std::string>::const_iterator sliced = opt.find("SLICED_THREADS");
+			if (sliced != opt.end()) {
+				m_param.b_sliced_threads = std::stoi(sliced->second);
 			}
-			param.i_threads = 1;
-			param.i_width = width;
-			param.i_height = height;
-			param.i_bframe = 0;
-			param.b_repeat_headers = 1;
+			std::map<std::string,std::string>::const_iterator lookahead = opt.find("LOOKAHEAD_THREADS");
+			if (lookahead != opt.end()) {
+				m_param.i_lookahead_threads = std::stoi(lookahead->second);
+			}
+			m_param.i_width = width;
+			m_param.i_height = height;
+
+			// pts are the capture times in microseconds, the rate control follows them
+			int fpsNum = 25, fpsDen = 1;
+			getFrameRate(opt, fpsNum, fpsDen);
+			m_param.i_fps_num = fpsNum;
+			m_param.i_fps_den = fpsDen;
+			m_param.i_timebase_num = 1;
+			m_param.i_timebase_den = 1000000;
+			m_param.b_vfr_input = 1;
+			m_param.i_bframe = 0;
+			m_param.b_repeat_headers = 1;
 
 			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
 			if (keyint != opt.end()) {
 				int value = std::stoi(keyint->second);	
-				param.i_keyint_min = value;
-				param.i_keyint_max = value;						
+				m_param.i_keyint_min = value;
+				m_param.i_keyint_max = value;						
+			}
+
+			// average bitrate in kbit/s, constant when the VBV is one second of it, a CBR bitrate wins over the default VBR one
+			std::map<std::string,std::string>::const_iterator cbr = opt.find("CBR");
+			std::map<std::string,std::string>::const_iterator vbr = opt.find("VBR");
+			if (cbr != opt.end()) {
+				int bitrate = std::stoi(cbr->second);
+				m_param.rc.i_rc_method = X264_RC_ABR;
+				m_param.rc.i_bitrate = bitrate;
+				m_param.rc.i_vbv_max_bitrate = bitrate;
+				m_param.rc.i_vbv_buffer_size = bitrate;
+			} else if (vbr != opt.end()) {
+				m_param.rc.i_rc_method = X264_RC_ABR;
+				m_param.rc.i_bitrate = std::stoi(vbr->second);
 			}
 
 			std::map<std::string,std::string>::const_iterator rc_qcp = opt.find("RC_CQP");
 			if (rc_qcp != opt.end()) {
 				int rc_value = std::stoi(rc_qcp->second);
-				param.rc.i_rc_method = X264_RC_CQP;
-				param.rc.i_qp_constant = rc_value;
-				param.rc.i_qp_min = rc_value; 
-				param.rc.i_qp_max = rc_value;
+				m_param.rc.i_rc_method = X264_RC_CQP;
+				m_param.rc.i_qp_constant = rc_value;
+				m_param.rc.i_qp_min = rc_value; 
+				m_param.rc.i_qp_max = rc_value;
 			}
 			std::map<std::string,std::string>::const_iterator rc_crf = opt.find("RC_CRF");
 			if (rc_crf != opt.end()) {	
 				int rc_value = std::stoi(rc_crf->second);		
-				param.rc.i_rc_method = X264_RC_CRF;
-				param.rc.f_rf_constant = rc_value;
-				param.rc.f_rf_constant_max = rc_value;
+				m_param.rc.i_rc_method = X264_RC_CRF;
+				m_param.rc.f_rf_constant = rc_value;
+				m_param.rc.f_rf_constant_max = rc_value;
 			}
 
 
-			LOG(NOTICE) << "rc_method:" << param.rc.i_rc_method; 
-			LOG(NOTICE) << "i_qp_constant:" << param.rc.i_qp_constant; 
-			LOG(NOTICE) << "f_rf_constant:" << param.rc.f_rf_constant; 
+			LOG(NOTICE) << "rc_method:" << m_param.rc.i_rc_method << " bitrate:" << m_param.rc.i_bitrate; 
+			LOG(NOTICE) << "i_qp_constant:" << m_param.rc.i_qp_constant; 
+			LOG(NOTICE) << "f_rf_constant:" << m_param.rc.f_rf_constant; 
+			LOG(NOTICE) << "preset:" << preset << " tune:" << tune; 
+			LOG(NOTICE) << "i_threads:" << m_param.i_threads << " b_sliced_threads:" << m_param.b_sliced_threads << " i_lookahead_threads:" << m_param.i_lookahead_threads; 
 			
 			x264_picture_init( &m_pic_in );
-			x264_picture_alloc(&m_pic_in, X264_CSP_I420, width, height);
-			
-			m_encoder = x264_encoder_open(&param);
+			x264_picture_init( &m_pic_wrap );
+		}
+
+		// x264 colorspace that can be read directly from a V4L2 format, 0 if none
+		static int getCsp(int format) {
+			int csp = 0;
+			switch (format) {
+				case V4L2_PIX_FMT_YUV420:  csp = X264_CSP_I420; break;
+				case V4L2_PIX_FMT_YVU420:  csp = X264_CSP_YV12; break;
+				case V4L2_PIX_FMT_NV12:    csp = X264_CSP_NV12; break;
+				case V4L2_PIX_FMT_NV21:    csp = X264_CSP_NV21; break;
+				case V4L2_PIX_FMT_YUV422P: csp = X264_CSP_I422; break;
+				case V4L2_PIX_FMT_NV16:    csp = X264_CSP_NV16; break;
+#ifdef X264_CSP_YUYV
+				case V4L2_PIX_FMT_YUYV:    csp = X264_CSP_YUYV; break;
+				case V4L2_PIX_FMT_UYVY:    csp = X264_CSP_UYVY; break;
+#endif
+			}
+			return csp;
+		}
+
+		static bool is422(int csp) {
+			return (csp == X264_CSP_I422) || (csp == X264_CSP_NV16)
+#ifdef X264_CSP_YUYV
+				|| (csp == X264_CSP_YUYV) || (csp == X264_CSP_UYVY)
+#endif
+				;
+		}
+
+		// open the encoder with the chroma subsampling of the capture format
+		void open(int format) {
+			if (m_encoder) {
+				x264_encoder_close(m_encoder);
+			}
+			m_informat = format;
+			m_param.i_csp = is422(getCsp(format)) ? X264_CSP_I422 : X264_CSP_I420;
+			LOG(NOTICE) << "input:" << V4l2Device::fourcc(format) << " x264 csp:" << m_param.i_csp; 
+
+			// the converted picture has the colorspace of the encoder, its planes follow each other like V4L2 planar formats
+			x264_picture_clean(&m_pic_in);
+			x264_picture_alloc(&m_pic_in, m_param.i_csp, m_width, m_height);
+
+			m_encoder = x264_encoder_open(&m_param);
 			if (!m_encoder)
 			{
 				LOG(WARN) << "Cannot create X264 encoder"; 
 			}			
 		}
 
-		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) {
+		// point the picture planes to the capture buffer when x264 can read its format
+		bool wrapPicture(const char* buffer, unsigned int rsize, int format) {
+				uint8_t* data = (uint8_t*)buffer;
+				int csp = getCsp(format);
+				int ysize = m_width*m_height;
+				int cwidth = (m_width+1)/2;
+				int cheight = is422(csp) ? m_height : (m_height+1)/2;
+				int csize = cwidth*cheight;
+				if ( (csp == 0) || (rsize < (unsigned int)(ysize + 2*csize)) ) {
+					return false;
+				}
+				m_pic_wrap.img.i_csp = csp;
+				switch (csp) {
+					case X264_CSP_I420:
+					case X264_CSP_YV12:
+					case X264_CSP_I422:
+						m_pic_wrap.img.i_plane = 3;
+						m_pic_wrap.img.i_stride[0] = m_width;
+						m_pic_wrap.img.i_stride[1] = cwidth;
+						m_pic_wrap.img.i_stride[2] = cwidth;
+						m_pic_wrap.img.plane[0] = data;
+						m_pic_wrap.img.plane[1] = data + ysize;
+						m_pic_wrap.img.plane[2] = data + ysize + csize;
+						break;
+					case X264_CSP_NV12:
+					case X264_CSP_NV21:
+					case X264_CSP_NV16:
+						m_pic_wrap.img.i_plane = 2;
+						m_pic_wrap.img.i_stride[0] = m_width;
+						m_pic_wrap.img.i_stride[1] = 2*cwidth;
+						m_pic_wrap.img.plane[0] = data;
+						m_pic_wrap.img.plane[1] = data + ysize;
+						break;
+					default:
+						// packed 4:2:2
+						m_pic_wrap.img.i_plane = 1;
+						m_pic_wrap.img.i_stride[0] = 4*cwidth;
+						m_pic_wrap.img.plane[0] = data;
+						break;
+				}
+				return true;
+		}
+
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
 
-				libyuv::ConvertToI420((const uint8*)buffer, rsize,
+				if (!m_encoder || (format != m_informat)) {
+					this->open(format);
+				}
+				if (!m_encoder) {
+					return;
+				}
+
+				uint64_t start = monotonicNow();
+				x264_picture_t* pic_in = &m_pic_in;
+				if (this->wrapPicture(buffer, rsize, format)) {
+					pic_in = &m_pic_wrap;
+				} else if (m_param.i_csp == X264_CSP_I422) {
+					// keep the 4:2:2 chroma the encoder is opened with
+					if (!m_converter422 || (m_converter422->getInputFormat() != format)) {
+						m_converter422.reset(new YuvConverter(format, V4L2_PIX_FMT_YUV422P, m_width, m_height));
+					}
+					YuvImage image;
+					unsigned int size = YuvConverter::layout(V4L2_PIX_FMT_YUV422P, m_width, m_height, NULL, image);
+					if (m_converter422->convert(buffer, rsize, (char*)m_pic_in.img.plane[0], size) < 0) {
+						LOG(WARN) << "Cannot convert " << V4l2Device::fourcc(format) << " to 4:2:2, frame skipped"; 
+						return;
+					}
+				} else {
+					this->convertToI420(buffer, rsize, format, m_width, m_height,
 						m_pic_in.img.plane[0], m_width,
 						m_pic_in.img.plane[1], (m_width+1)/2,
-						m_pic_in.img.plane[2], (m_width+1)/2,
-						0, 0,
-						m_width, m_height,
-						m_width, m_height,
-						libyuv::kRotate0, format);
+						m_pic_in.img.plane[2], (m_width+1)/2);
+				}
+				m_convertTime = monotonicNow() - start;
+				pic_in->i_pts = this->pushFrameInfo();
 
 					x264_nal_t* nals = NULL;
 					int i_nals = 0;
-					x264_encoder_encode(m_encoder, &nals, &i_nals, &m_pic_in, &m_pic_out);
-										
-					if (i_nals > 1) {
+					x264_encoder_encode(m_encoder, &nals, &i_nals, pic_in, &m_pic_out);
+					this->writeNals(nals, i_nals, sink);
+		}
+
+		// write the frames still delayed in the encoder
+		void flush(FrameSink* sink) {
+				while (m_encoder && (x264_encoder_delayed_frames(m_encoder) > 0)) {
+					x264_nal_t* nals = NULL;
+					int i_nals = 0;
+					if (x264_encoder_encode(m_encoder, &nals, &i_nals, NULL, &m_pic_out) < 0) {
+						break;
+					}
+					this->writeNals(nals, i_nals, sink);
+				}
+		}
+
+		// x264 guarantees that the NAL payloads are sequential in memory
+		void writeNals(x264_nal_t* nals, int i_nals, FrameSink* sink) {
+					if (i_nals > 0) {
+						sink->setFrameInfo(this->popFrameInfo(m_pic_out.i_pts));
 						int size = 0;
 						for (int i=0; i < i_nals; ++i) {
 							size+=nals[i].i_payload;
 						}
-						char buffer[size];
-						char* ptr = buffer;
-						for (int i=0; i < i_nals; ++i) {
-							memcpy(ptr, nals[i].p_payload, nals[i].i_payload);									
-							ptr+=nals[i].i_payload;
-						}
-						
-						int wsize = videoOutput->write(buffer,size);
+						int wsize = sink->write((char*)nals[0].p_payload, size);
 						LOG(DEBUG) << "Copied nbnal:" << i_nals << " size:" << wsize; 					
-						
-					} else if (i_nals == 1) {
-						int wsize = videoOutput->write((char*)nals[0].p_payload, nals[0].i_payload);
-						LOG(DEBUG) << "Copied size:" << wsize; 					
-					}				
+					}
 		}			
 						
 		~X264Encoder() {
 				x264_picture_clean(&m_pic_in);
-				x264_encoder_close(m_encoder);
+				if (m_encoder) {
+					x264_encoder_close(m_encoder);
+				}
 		}				
 
 	private:
 		x264_t* m_encoder;
+		x264_param_t m_param;
+		int m_informat;
 		x264_picture_t m_pic_in;
+		x264_picture_t m_pic_wrap;
 		x264_picture_t m_pic_out;
 		int m_width;
 		int m_height;
+		std::unique_ptr<YuvConverter> m_converter422;
 };
@@ -25,112 +25,214 @@ extern "C"
 class X265Encoder : public Encoder {
 	public:
 		X265Encoder(int format, int width, int height, const std::map<std::string,std::string> & opt, int verbose) 
-            : m_encoder(NULL), m_pic_in(NULL), m_pic_out(NULL), m_buff(NULL)
+            : m_encoder(NULL), m_pic_in(NULL), m_pic_wrap(NULL), m_pic_out(NULL), m_buff(NULL)
+            , m_informat(0)
             , m_width(width)
             , m_height(height) {
 
-			x265_param param;
-			x265_param_default_preset(&param, "ultrafast", "zerolatency");
+			x265_param_default_preset(&m_param, "ultrafast", "zerolatency");
 			if (verbose>1)
 			{
-				param.logLevel = X265_LOG_DEBUG;
+				m_param.logLevel = X265_LOG_DEBUG;
 			}
-			param.sourceWidth = width;
-			param.sourceHeight = height;
-			param.bframes = 0;
-			param.bRepeatHeaders = 1;						
-			param.bOpenGOP = 0;
-			param.fpsNum = 1;
-			param.fpsDenom = 1;
+			m_param.sourceWidth = width;
+			m_param.sourceHeight = height;
+			m_param.bframes = 0;
+			m_param.bRepeatHeaders = 1;						
+			m_param.bOpenGOP = 0;
+			int fpsNum = 25, fpsDen = 1;
+			getFrameRate(opt, fpsNum, fpsDen);
+			m_param.fpsNum = fpsNum;
+			m_param.fpsDenom = fpsDen;
 
 			std::map<std::string,std::string>::const_iterator keyint = opt.find("GOP");
 			if (keyint != opt.end()) {
 				int value = std::stoi(keyint->second);	
-				param.keyframeMin = value;
-				param.keyframeMax = value;						
-				param.fpsDenom = value;
+				m_param.keyframeMin = value;
+				m_param.keyframeMax = value;						
 			}			
 
+			// average bitrate in kbit/s, constant when the VBV is one second of it, a CBR bitrate wins over the default VBR one
+			std::map<std::string,std::string>::const_iterator cbr = opt.find("CBR");
+			std::map<std::string,std::string>::const_iterator vbr = opt.find("VBR");
+			if (cbr != opt.end()) {
+				int bitrate = std::stoi(cbr->second);
+				m_param.rc.rateControlMode = X265_RC_ABR;
+				m_param.rc.bitrate = bitrate;
+				m_param.rc.vbvMaxBitrate = bitrate;
+				m_param.rc.vbvBufferSize = bitrate;
+			} else if (vbr != opt.end()) {
+				m_param.rc.rateControlMode = X265_RC_ABR;
+				m_param.rc.bitrate = std::stoi(vbr->second);
+			}
+
 			std::map<std::string,std::string>::const_iterator rc_qcp = opt.find("RC_CQP");
 			if (rc_qcp != opt.end()) {
 				int rc_value = std::stoi(rc_qcp->second);
-				param.rc.rateControlMode = X265_RC_CQP;
-				param.rc.qp = rc_value;
+				m_param.rc.rateControlMode = X265_RC_CQP;
+				m_param.rc.qp = rc_value;
 			}			
 			std::map<std::string,std::string>::const_iterator rc_crf = opt.find("RC_CRF");
 			if (rc_crf != opt.end()) {	
 				int rc_value = std::stoi(rc_crf->second);		
-				param.rc.rateControlMode = X265_RC_CRF;
-				param.rc.rfConstantMin = rc_value;
-				param.rc.rfConstantMax = rc_value;
+				m_param.rc.rateControlMode = X265_RC_CRF;
+				m_param.rc.rfConstantMin = rc_value;
+				m_param.rc.rfConstantMax = rc_value;
 			}
 			
             m_pic_in = x265_picture_alloc();
-            x265_picture_init(&param, m_pic_in);
-            m_buff= new char[width*height*3/2];
-            m_pic_in->planes[0]=m_buff;
-            m_pic_in->planes[1]=m_buff+width*height;
-            m_pic_in->planes[2]=m_buff+width*height*5/4;
-            
+            m_pic_wrap = x265_picture_alloc();
             m_pic_out = x265_picture_alloc();
+            // large enough for planar 4:2:0 or 4:2:2
+            m_buff= new char[width*height + 2*((width+1)/2)*height];
+		}
+
+		// x265 chroma subsampling that keeps the one of the V4L2 format
+		static int getCsp(int format) {
+			int csp = X265_CSP_I420;
+			switch (format) {
+				case V4L2_PIX_FMT_YUV422P:
+				case V4L2_PIX_FMT_YUYV:
+				case V4L2_PIX_FMT_UYVY:
+					csp = X265_CSP_I422; 
+					break;
+			}
+			return csp;
+		}
+
+		// open the encoder with the chroma subsampling of the capture format
+		void open(int format) {
+			if (m_encoder) {
+				x265_encoder_close(m_encoder);
+			}
+			m_informat = format;
+			m_param.internalCsp = getCsp(format);
+			LOG(NOTICE) << "input:" << V4l2Device::fourcc(format) << " x265 csp:" << m_param.internalCsp; 
 
-			m_encoder = x265_encoder_open(&param);
+			int cwidth = (m_width+1)/2;
+			int cheight = (m_param.internalCsp == X265_CSP_I422) ? m_height : (m_height+1)/2;
+            x265_picture_init(&m_param, m_pic_in);
+            m_pic_in->planes[0]=m_buff;
+            m_pic_in->planes[1]=m_buff+m_width*m_height;
+            m_pic_in->planes[2]=m_buff+m_width*m_height+cwidth*cheight;
+            m_pic_in->stride[0]=m_width;
+            m_pic_in->stride[1]=cwidth;
+            m_pic_in->stride[2]=cwidth;
+            x265_picture_init(&m_param, m_pic_wrap);
+
+			m_encoder = x265_encoder_open(&m_param);
 			if (!m_encoder)
 			{
 				LOG(WARN) << "Cannot create X265 encoder"; 
 			}
 		}
 
-		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, V4l2Output* videoOutput) {
+		// point the picture planes to the capture buffer when it is already planar
+		bool wrapPicture(const char* buffer, unsigned int rsize, int format) {
+				char* data = (char*)buffer;
+				int ysize = m_width*m_height;
+				int cwidth = (m_width+1)/2;
+				int cheight = (format == V4L2_PIX_FMT_YUV422P) ? m_height : (m_height+1)/2;
+				int csize = cwidth*cheight;
+				if ( (rsize < (unsigned int)(ysize + 2*csize)) 
+				   || ((format != V4L2_PIX_FMT_YUV420) && (format != V4L2_PIX_FMT_YVU420) && (format != V4L2_PIX_FMT_YUV422P)) ) {
+					return false;
+				}
+				int uoffset = (format == V4L2_PIX_FMT_YVU420) ? ysize + csize : ysize;
+				int voffset = (format == V4L2_PIX_FMT_YVU420) ? ysize : ysize + csize;
+				m_pic_wrap->planes[0] = data;
+				m_pic_wrap->planes[1] = data + uoffset;
+				m_pic_wrap->planes[2] = data + voffset;
+				m_pic_wrap->stride[0] = m_width;
+				m_pic_wrap->stride[1] = cwidth;
+				m_pic_wrap->stride[2] = cwidth;
+				return true;
+		}
+
+		void convertEncodeWrite(const char* buffer, unsigned int rsize, int format, FrameSink* sink) {
+
+				if (!m_encoder || (format != m_informat)) {
+					this->open(format);
+				}
+				if (!m_encoder) {
+					return;
+				}
 
-				libyuv::ConvertToI420((const uint8*)buffer, rsize,
+				uint64_t start = monotonicNow();
+				x265_picture* pic_in = m_pic_in;
+				if (this->wrapPicture(buffer, rsize, format)) {
+					pic_in = m_pic_wrap;
+				} else if (m_param.internalCsp == X265_CSP_I422) {
+					// keep the 4:2:2 chroma the encoder is opened with, the planes of m_buff follow each other like YUV422P
+					if (!m_converter422 || (m_converter422->getInputFormat() != format)) {
+						m_converter422.reset(new YuvConverter(format, V4L2_PIX_FMT_YUV422P, m_width, m_height));
+					}
+					YuvImage image;
+					unsigned int size = YuvConverter::layout(V4L2_PIX_FMT_YUV422P, m_width, m_height, NULL, image);
+					if (m_converter422->convert(buffer, rsize, m_buff, size) < 0) {
+						LOG(WARN) << "Cannot convert " << V4l2Device::fourcc(format) << " to 4:2:2, frame skipped"; 
+						return;
+					}
+				} else {
+					this->convertToI420(buffer, rsize, format, m_width, m_height,
 							(uint8*)m_pic_in->planes[0], m_width,
 							(uint8*)m_pic_in->planes[1], (m_width+1)/2,
-							(uint8*)m_pic_in->planes[2], (m_width+1)/2,
-							0, 0,
-							m_width, m_height,
-							m_width, m_height,
-							libyuv::kRotate0, format);
+							(uint8*)m_pic_in->planes[2], (m_width+1)/2);
+				}
+				m_convertTime = monotonicNow() - start;
+				pic_in->pts = this->pushFrameInfo();
 
 					x265_nal* nals = NULL;
 					uint32_t i_nals = 0;
-                    if (x265_encoder_encode(m_encoder, &nals, &i_nals, m_pic_in, m_pic_out) > 0) {
-                        if (i_nals > 1) {
-                            int size = 0;
-                            for (int i=0; i < i_nals; ++i) {
-                                size+=nals[i].sizeBytes;
-                            }
-                            char buffer[size];
-                            char* ptr = buffer;
-                            for (int i=0; i < i_nals; ++i) {
-                                memcpy(ptr, nals[i].payload, nals[i].sizeBytes);	
-                                ptr+=nals[i].sizeBytes;
-                            }
-                            
-                            int wsize = videoOutput->write(buffer,size);
-                            LOG(DEBUG) << "Copied nbnal:" << i_nals << " size:" << wsize; 					
-                            
-                        } else if (i_nals == 1) {
-                            int wsize = videoOutput->write((char*)nals[0].payload, nals[0].sizeBytes);
-                            LOG(DEBUG) << "Copied size:" << wsize; 					
-                        }				
+                    if (x265_encoder_encode(m_encoder, &nals, &i_nals, pic_in, m_pic_out) > 0) {
+                        this->writeNals(nals, i_nals, sink);
                     } else {
                         LOG(NOTICE) << "encoder error"; 
                     }
 		}			
 						
+		// write the frames still delayed in the encoder
+		void flush(FrameSink* sink) {
+				x265_nal* nals = NULL;
+				uint32_t i_nals = 0;
+				while (m_encoder && (x265_encoder_encode(m_encoder, &nals, &i_nals, NULL, m_pic_out) > 0)) {
+					this->writeNals(nals, i_nals, sink);
+				}
+		}
+
+		// write all the NALs of a frame without concatenating them
+		void writeNals(x265_nal* nals, uint32_t i_nals, FrameSink* sink) {
+				if (i_nals > 0) {
+					sink->setFrameInfo(this->popFrameInfo(m_pic_out->pts));
+					struct iovec iov[i_nals];
+					for (uint32_t i=0; i < i_nals; ++i) {
+						iov[i].iov_base = nals[i].payload;
+						iov[i].iov_len  = nals[i].sizeBytes;
+					}
+					int wsize = sink->writev(iov, i_nals);
+					LOG(DEBUG) << "Copied nbnal:" << i_nals << " size:" << wsize; 					
+				}
+		}
+
 		~X265Encoder() {
                 delete [] m_buff;
 				x265_picture_free(m_pic_in);
+				x265_picture_free(m_pic_wrap);
 				x265_picture_free(m_pic_out);
-				x265_encoder_close(m_encoder);
+				if (m_encoder) {
+					x265_encoder_close(m_encoder);
+				}
 		}				
 
 	private:
 		x265_encoder* m_encoder;
+		x265_param m_param;
 		x265_picture* m_pic_in;
+		x265_picture* m_pic_wrap;
 		x265_picture* m_pic_out;
         char* m_buff;
+		int m_informat;
 		int m_width;
 		int m_height;
+		std::unique_ptr<YuvConverter> m_converter422;
 };
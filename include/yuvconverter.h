@@ -0,0 +1,636 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** yuvconverter.h
+**
+** Convert, crop, rotate and scale raw frames from a V4L2 format to an other
+** one, using a direct libyuv kernel when one exists and an intermediate I420
+** image otherwise
+**
+** -------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "libyuv.h"
+#include "logger.h"
+
+#include "V4l2Device.h"
+
+#include "workerpool.h"
+
+// planes of a frame, U and V are always the planes 1 and 2 (interleaved in plane 1 for NV12/NV21)
+struct YuvImage {
+	uint8* m_plane[3];
+	int    m_stride[3];
+};
+
+// crop rectangle, flips and rotation applied by ConvertToI420
+// the flips apply to the cropped image before the rotation
+struct YuvTransform {
+	YuvTransform() : m_x(0), m_y(0), m_width(0), m_height(0), m_rotation(libyuv::kRotate0), m_hflip(false), m_vflip(false) {}
+
+	// parse a crop geometry WxH+X+Y
+	bool parseCrop(const std::string & crop) {
+		m_x = m_y = 0;
+		return (sscanf(crop.c_str(), "%dx%d+%d+%d", &m_width, &m_height, &m_x, &m_y) >= 2) && (m_width > 0) && (m_height > 0) && (m_x >= 0) && (m_y >= 0);
+	}
+
+	bool parseRotation(const std::string & rotation) {
+		int angle = atoi(rotation.c_str());
+		switch (angle) {
+			case 0:   m_rotation = libyuv::kRotate0; break;
+			case 90:  m_rotation = libyuv::kRotate90; break;
+			case 180: m_rotation = libyuv::kRotate180; break;
+			case 270: m_rotation = libyuv::kRotate270; break;
+			default: return false;
+		}
+		return true;
+	}
+
+	// h, v or hv
+	bool parseFlip(const std::string & flip) {
+		m_hflip = (flip.find('h') != std::string::npos);
+		m_vflip = (flip.find('v') != std::string::npos);
+		return (flip.find_first_not_of("hv") == std::string::npos);
+	}
+
+	// clamp the crop rectangle to the frame, with an even origin to keep the chroma aligned
+	void resolve(int width, int height) {
+		m_x = std::min(m_x & ~1, std::max(0, width-2));
+		m_y = std::min(m_y & ~1, std::max(0, height-2));
+		m_width = (m_width > 0) ? std::min(m_width, width - m_x) : width - m_x;
+		m_height = (m_height > 0) ? std::min(m_height, height - m_y) : height - m_y;
+	}
+
+	bool isIdentity(int width, int height) const {
+		return (m_x == 0) && (m_y == 0) && (m_width == width) && (m_height == height) && (m_rotation == libyuv::kRotate0) && !m_hflip && !m_vflip;
+	}
+
+	int getOutputWidth() const  { return ((m_rotation == libyuv::kRotate90) || (m_rotation == libyuv::kRotate270)) ? m_height : m_width; }
+	int getOutputHeight() const { return ((m_rotation == libyuv::kRotate90) || (m_rotation == libyuv::kRotate270)) ? m_width : m_height; }
+
+	int                 m_x;
+	int                 m_y;
+	int                 m_width;
+	int                 m_height;
+	libyuv::RotationMode m_rotation;
+	bool                m_hflip;
+	bool                m_vflip;
+};
+
+class YuvConverter {
+	public:
+		typedef int (*Kernel)(const YuvImage & src, const YuvImage & dst, int width, int height);
+
+		YuvConverter(int informat, int outformat, int width, int height, int outwidth = 0, int outheight = 0, libyuv::FilterMode filter = libyuv::kFilterBox, const YuvTransform & transform = YuvTransform())
+			: m_informat(informat), m_outformat(outformat)
+			, m_width(width), m_height(height)
+			, m_filter(filter)
+			, m_transform(transform)
+			, m_kernel(NULL)
+			, m_bands(false)
+			, m_stripes(1) {
+
+			// size of the image once cropped and rotated
+			m_transform.resolve(width, height);
+			m_transformed = !m_transform.isIdentity(width, height);
+			m_twidth = m_transform.getOutputWidth();
+			m_theight = m_transform.getOutputHeight();
+			m_outwidth = outwidth ? outwidth : m_twidth;
+			m_outheight = outheight ? outheight : m_theight;
+
+			m_scale = (m_outwidth != m_twidth) || (m_outheight != m_theight);
+			m_path = "i420";
+			if (m_scale) {
+				if ( (informat == V4L2_PIX_FMT_BGR32) && (outformat == V4L2_PIX_FMT_BGR32) && !m_transformed ) {
+					m_path = "argb-scale";
+				} else {
+					// scale I420 planes, at input size only when the input is not already I420
+					// and cannot be converted in bands of a few rows
+					m_bands = this->canConvertInBands();
+					if (m_bands) {
+						m_path = "i420-bands+scale";
+					} else if ( (canonical(informat) != V4L2_PIX_FMT_YUV420) || m_transformed ) {
+						allocate(m_i420buffer, m_i420, m_twidth, m_theight);
+						m_path = "i420+scale";
+					} else {
+						m_path = "scale";
+					}
+					if (canonical(outformat) != V4L2_PIX_FMT_YUV420) {
+						allocate(m_scaledbuffer, m_scaled, m_outwidth, m_outheight);
+						m_path += "+convert";
+					}
+				}
+			} else if (m_transformed) {
+				if (canonical(outformat) != V4L2_PIX_FMT_YUV420) {
+					allocate(m_i420buffer, m_i420, m_twidth, m_theight);
+				} else {
+					m_path = "to-i420";
+				}
+			} else if (informat == outformat) {
+				m_path = "copy";
+			} else if ( (m_kernel = findKernel(informat, outformat)) != NULL ) {
+				m_path = "direct";
+			} else if (canonical(informat) == V4L2_PIX_FMT_YUV420) {
+				m_path = "from-i420";
+			} else if (canonical(outformat) == V4L2_PIX_FMT_YUV420) {
+				m_path = "to-i420";
+			} else {
+				allocate(m_i420buffer, m_i420, m_width, m_height);
+			}
+			if (m_transformed) {
+				m_path += " crop:" + std::to_string(m_transform.m_width) + "x" + std::to_string(m_transform.m_height) 
+					+ "+" + std::to_string(m_transform.m_x) + "+" + std::to_string(m_transform.m_y)
+					+ " rotate:" + std::to_string((int)m_transform.m_rotation)
+					+ (m_transform.m_hflip ? " hflip" : "") + (m_transform.m_vflip ? " vflip" : "");
+			}
+			LOG(NOTICE) << "Conversion " << V4l2Device::fourcc(informat) << " " << m_width << "x" << m_height 
+				<< "->" << V4l2Device::fourcc(outformat) << " " << m_outwidth << "x" << m_outheight 
+				<< " path:" << m_path;
+		}
+
+		// input could be written as is
+		bool isPassthrough() const { return (m_informat == m_outformat) && !m_scale && !m_transformed; }
+
+		const std::string & getPath() const { return m_path; }
+		int getInputFormat() const { return m_informat; }
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		int getOutputWidth() const { return m_outwidth; }
+		int getOutputHeight() const { return m_outheight; }
+
+		// split conversion and scaling in horizontal stripes processed by a pool of threads
+		void setStripes(int stripes) {
+			m_stripes = std::max(1, stripes);
+			m_pool.reset();
+			if (m_stripes > 1) {
+				int threads = std::min(m_stripes, (int)std::max(1u, std::thread::hardware_concurrency()));
+				m_pool.reset(new WorkerPool(threads));
+				LOG(NOTICE) << "Conversion in " << m_stripes << " stripes using " << threads << " threads";
+			}
+		}
+
+		// convert a frame to the given I420 planes (output format YU12 or YV12 without scaling, planes of the transformed size)
+		int convert(const char* in, unsigned int insize, const YuvImage & dst) {
+			YuvImage src;
+			unsigned int srcsize = layout(m_informat, m_width, m_height, (uint8*)in, src);
+			if (srcsize > insize) {
+				LOG(WARN) << "Buffer too small input:" << insize << "/" << srcsize;
+				return -1;
+			}
+			return this->toI420(in, insize, src, dst);
+		}
+
+		// convert a frame, return the size of the output or -1
+		int convert(const char* in, unsigned int insize, char* out, unsigned int outsize) {
+			int ret = -1;
+			YuvImage src;
+			YuvImage dst;
+			unsigned int srcsize = layout(m_informat, m_width, m_height, (uint8*)in, src);
+			unsigned int dstsize = layout(m_outformat, m_outwidth, m_outheight, (uint8*)out, dst);
+			if ( (srcsize > insize) || (dstsize > outsize) ) {
+				LOG(WARN) << "Buffer too small input:" << insize << "/" << srcsize << " output:" << outsize << "/" << dstsize;
+			} else if (m_scale) {
+				ret = this->convertScale(in, insize, src, dst, out);
+			} else if (isPassthrough()) {
+				// the capture buffer can be padded past the image, formats without layout are copied as far as they fit
+				ret = dstsize ? dstsize : std::min(insize, outsize);
+				memcpy(out, in, ret);
+			} else if (m_kernel) {
+				ret = this->runKernel(m_kernel, m_informat, src, m_outformat, dst, m_width, m_height);
+			} else if ( (canonical(m_informat) == V4L2_PIX_FMT_YUV420) && !m_transformed ) {
+				ret = this->fromI420(src, out, m_width, m_height);
+			} else if (canonical(m_outformat) == V4L2_PIX_FMT_YUV420) {
+				ret = this->toI420(in, insize, src, dst);
+			} else {
+				ret = this->toI420(in, insize, src, m_i420);
+				if (ret == 0) {
+					ret = this->fromI420(m_i420, out, m_twidth, m_theight);
+				}
+			}
+			if (ret == 0) {
+				ret = dstsize ? dstsize : outsize;
+			}
+			return ret;
+		}
+
+		static bool parseFilter(const std::string & name, libyuv::FilterMode & filter) {
+			if (name == "none") {
+				filter = libyuv::kFilterNone;
+			} else if (name == "linear") {
+				filter = libyuv::kFilterLinear;
+			} else if (name == "bilinear") {
+				filter = libyuv::kFilterBilinear;
+			} else if (name == "box") {
+				filter = libyuv::kFilterBox;
+			} else {
+				return false;
+			}
+			return true;
+		}
+
+		// describe the planes of a frame, return the frame size (0 if the format is not known)
+		static unsigned int layout(int format, int width, int height, uint8* buffer, YuvImage & image) {
+			int cwidth = (width+1)/2;
+			int cheight = (height+1)/2;
+			unsigned int size = 0;
+			memset(&image, 0, sizeof(image));
+			switch (format) {
+				case V4L2_PIX_FMT_YUV420:
+				case V4L2_PIX_FMT_YVU420:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = width;
+					image.m_plane[1] = buffer + width*height;
+					image.m_stride[1] = cwidth;
+					image.m_plane[2] = image.m_plane[1] + cwidth*cheight;
+					image.m_stride[2] = cwidth;
+					if (format == V4L2_PIX_FMT_YVU420) {
+						std::swap(image.m_plane[1], image.m_plane[2]);
+					}
+					size = width*height + 2*cwidth*cheight;
+				break;
+				case V4L2_PIX_FMT_YUV422P:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = width;
+					image.m_plane[1] = buffer + width*height;
+					image.m_stride[1] = cwidth;
+					image.m_plane[2] = image.m_plane[1] + cwidth*height;
+					image.m_stride[2] = cwidth;
+					size = width*height + 2*cwidth*height;
+				break;
+				case V4L2_PIX_FMT_NV12:
+				case V4L2_PIX_FMT_NV21:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = width;
+					image.m_plane[1] = buffer + width*height;
+					image.m_stride[1] = 2*cwidth;
+					size = width*height + 2*cwidth*cheight;
+				break;
+				case V4L2_PIX_FMT_YUYV:
+				case V4L2_PIX_FMT_UYVY:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = 2*width;
+					size = 2*width*height;
+				break;
+				case V4L2_PIX_FMT_BGR24:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = 3*width;
+					size = 3*width*height;
+				break;
+				case V4L2_PIX_FMT_BGR32:
+					image.m_plane[0] = buffer;
+					image.m_stride[0] = 4*width;
+					size = 4*width*height;
+				break;
+			}
+			if (buffer == NULL) {
+				memset(&image, 0, sizeof(image));
+			}
+			return size;
+		}
+
+	private:
+		// planes of an image starting at the given row (even for 4:2:0 formats)
+		static YuvImage offset(int format, const YuvImage & image, int row) {
+			YuvImage band = image;
+			int crow = row;
+			if ( (format == V4L2_PIX_FMT_YUV420) || (format == V4L2_PIX_FMT_YVU420) || (format == V4L2_PIX_FMT_NV12) || (format == V4L2_PIX_FMT_NV21) ) {
+				crow = row/2;
+			}
+			if (band.m_plane[0]) band.m_plane[0] += row*band.m_stride[0];
+			if (band.m_plane[1]) band.m_plane[1] += crow*band.m_stride[1];
+			if (band.m_plane[2]) band.m_plane[2] += crow*band.m_stride[2];
+			return band;
+		}
+
+		// run a kernel on horizontal stripes of the frame
+		int runKernel(Kernel kernel, int informat, const YuvImage & src, int outformat, const YuvImage & dst, int width, int height) {
+			int stripes = std::min(m_stripes, height/2);
+			if (stripes <= 1) {
+				return kernel(src, dst, width, height);
+			}
+			std::atomic<int> ret(0);
+			m_pool->run(stripes, [&](int index) {
+				int first = (index*height/stripes) & ~1;
+				int last = (index+1 == stripes) ? height : ((index+1)*height/stripes) & ~1;
+				if (kernel(offset(informat, src, first), offset(outformat, dst, first), width, last-first) != 0) {
+					ret = -1;
+				}
+			});
+			return ret;
+		}
+
+		static int gcd(int a, int b) {
+			while (b) {
+				int t = a % b;
+				a = b;
+				b = t;
+			}
+			return a;
+		}
+
+		// stripes of a plane scale like the whole plane when the filter libyuv really applies does not interpolate rows:
+		// like its ScaleFilterReduce box becomes bilinear unless both axes are reduced by 2 or more,
+		// and linear upscales by 2 map the rows from the edges of the plane
+		static bool isBandable(int srcwidth, int srcheight, int dstwidth, int dstheight, libyuv::FilterMode filter) {
+			if ( (filter == libyuv::kFilterBox) && ((dstwidth*2 >= srcwidth) || (dstheight*2 >= srcheight)) ) {
+				filter = libyuv::kFilterBilinear;
+			}
+			if ( (filter == libyuv::kFilterBilinear) && ((srcheight == 1) || (dstheight == srcheight) || (dstheight*3 == srcheight)) ) {
+				filter = libyuv::kFilterLinear;
+			}
+			return (filter == libyuv::kFilterNone) || (filter == libyuv::kFilterBox) || ((filter == libyuv::kFilterLinear) && (dstheight <= srcheight));
+		}
+
+		// scale I420 planes, in stripes whose boundaries fall on whole source rows
+		// when the filter reads across stripe boundaries the planes are scaled in parallel instead
+		int scaleI420(const YuvImage & src, const YuvImage & dst) {
+			int cwidth = (m_twidth+1)/2;
+			int cheight = (m_theight+1)/2;
+			int outcwidth = (m_outwidth+1)/2;
+			int outcheight = (m_outheight+1)/2;
+			if (!m_pool) {
+				return libyuv::I420Scale(src.m_plane[0], src.m_stride[0],
+						src.m_plane[1], src.m_stride[1],
+						src.m_plane[2], src.m_stride[2],
+						m_twidth, m_theight,
+						dst.m_plane[0], dst.m_stride[0],
+						dst.m_plane[1], dst.m_stride[1],
+						dst.m_plane[2], dst.m_stride[2],
+						m_outwidth, m_outheight,
+						m_filter);
+			}
+
+			// chroma rows of the output that map to a whole number of chroma rows of the input
+			int unit = outcheight / gcd(cheight, outcheight);
+			int units = outcheight / unit;
+			int stripes = std::min(m_stripes, units);
+			bool banded = isBandable(m_twidth, m_theight, m_outwidth, m_outheight, m_filter) && isBandable(cwidth, cheight, outcwidth, outcheight, m_filter)
+				&& (m_theight % 2 == 0) && (m_outheight % 2 == 0) && (stripes > 1);
+			if (!banded) {
+				m_pool->run(3, [&](int plane) {
+					if (plane == 0) {
+						libyuv::ScalePlane(src.m_plane[0], src.m_stride[0], m_twidth, m_theight, dst.m_plane[0], dst.m_stride[0], m_outwidth, m_outheight, m_filter);
+					} else {
+						libyuv::ScalePlane(src.m_plane[plane], src.m_stride[plane], cwidth, cheight, dst.m_plane[plane], dst.m_stride[plane], outcwidth, outcheight, m_filter);
+					}
+				});
+				return 0;
+			}
+			m_pool->run(stripes, [&](int index) {
+				int first = (index*units/stripes)*unit;
+				int last = ((index+1)*units/stripes)*unit;
+				int srcfirst = first*cheight/outcheight;
+				int srclast = last*cheight/outcheight;
+				libyuv::ScalePlane(src.m_plane[0] + 2*srcfirst*src.m_stride[0], src.m_stride[0], m_twidth, 2*(srclast-srcfirst),
+						dst.m_plane[0] + 2*first*dst.m_stride[0], dst.m_stride[0], m_outwidth, 2*(last-first), m_filter);
+				for (int plane = 1; plane < 3; ++plane) {
+					libyuv::ScalePlane(src.m_plane[plane] + srcfirst*src.m_stride[plane], src.m_stride[plane], cwidth, srclast-srcfirst,
+							dst.m_plane[plane] + first*dst.m_stride[plane], dst.m_stride[plane], outcwidth, last-first, m_filter);
+				}
+			});
+			return 0;
+		}
+
+		static void allocate(std::vector<uint8> & buffer, YuvImage & image, int width, int height) {
+			buffer.resize(layout(V4L2_PIX_FMT_YUV420, width, height, NULL, image));
+			layout(V4L2_PIX_FMT_YUV420, width, height, buffer.data(), image);
+		}
+
+		// convert the input to I420 planes of the transformed size
+		int toI420(const char* in, unsigned int insize, const YuvImage & src, const YuvImage & dst) {
+			if (m_transformed) {
+				// an horizontal flip is a vertical flip (negative height) rotated by 180 degrees
+				int rotation = (m_transform.m_rotation + (m_transform.m_hflip ? 180 : 0)) % 360;
+				bool vflip = (m_transform.m_vflip != m_transform.m_hflip);
+				return libyuv::ConvertToI420((const uint8*)in, insize,
+						dst.m_plane[0], dst.m_stride[0],
+						dst.m_plane[1], dst.m_stride[1],
+						dst.m_plane[2], dst.m_stride[2],
+						m_transform.m_x, m_transform.m_y,
+						m_width, vflip ? -m_height : m_height,
+						m_transform.m_width, m_transform.m_height,
+						(libyuv::RotationMode)rotation, m_informat);
+			}
+			Kernel kernel = findKernel(m_informat, V4L2_PIX_FMT_YUV420);
+			if (kernel) {
+				return this->runKernel(kernel, m_informat, src, V4L2_PIX_FMT_YUV420, dst, m_width, m_height);
+			}
+			return libyuv::ConvertToI420((const uint8*)in, insize,
+					dst.m_plane[0], dst.m_stride[0],
+					dst.m_plane[1], dst.m_stride[1],
+					dst.m_plane[2], dst.m_stride[2],
+					0, 0,
+					m_width, m_height,
+					m_width, m_height,
+					libyuv::kRotate0, m_informat);
+		}
+
+		// convert I420 planes to the output format
+		int fromI420(const YuvImage & src, char* out, int width, int height) {
+			Kernel kernel = findKernel(V4L2_PIX_FMT_YUV420, m_outformat);
+			if (kernel) {
+				YuvImage dst;
+				layout(m_outformat, width, height, (uint8*)out, dst);
+				return this->runKernel(kernel, V4L2_PIX_FMT_YUV420, src, m_outformat, dst, width, height);
+			}
+			return libyuv::ConvertFromI420(src.m_plane[0], src.m_stride[0],
+					src.m_plane[1], src.m_stride[1],
+					src.m_plane[2], src.m_stride[2],
+					(uint8*)out, 0,
+					width, height,
+					m_outformat);
+		}
+
+		// packed and semi-planar inputs with a kernel to I420 can be converted a few rows at a time and each band scaled
+		// while it is still in cache, when the filter scales a band like the whole frame (see scaleI420)
+		bool canConvertInBands() const {
+			return !m_transformed && (canonical(m_informat) != V4L2_PIX_FMT_YUV420) && (findKernel(m_informat, V4L2_PIX_FMT_YUV420) != NULL)
+				&& (m_height % 2 == 0) && (m_outheight % 2 == 0)
+				&& isBandable(m_width, m_height, m_outwidth, m_outheight, m_filter)
+				&& isBandable((m_width+1)/2, m_height/2, (m_outwidth+1)/2, m_outheight/2, m_filter);
+		}
+
+		// convert whole units of source rows to I420 in a band buffer and scale it into the output, one band after the
+		// other in each stripe, so the full size I420 image is never written
+		int convertScaleBands(const YuvImage & src, const YuvImage & dst) {
+			Kernel kernel = findKernel(m_informat, V4L2_PIX_FMT_YUV420);
+			int cwidth = (m_width+1)/2;
+			int cheight = m_height/2;
+			int outcwidth = (m_outwidth+1)/2;
+			int outcheight = m_outheight/2;
+			int unit = outcheight / gcd(cheight, outcheight);
+			int units = outcheight / unit;
+			int srcunit = cheight / gcd(cheight, outcheight);
+			int bandunits = std::max(1, BAND_SIZE / (2*srcunit*(m_width + cwidth)));
+			int stripes = m_pool ? std::min(m_stripes, units) : 1;
+			if ((int)m_bandbuffers.size() < stripes) {
+				m_bandbuffers.resize(stripes);
+			}
+			std::atomic<int> ret(0);
+			auto run = [&](int index) {
+				YuvImage band;
+				allocate(m_bandbuffers[index], band, m_width, 2*srcunit*bandunits);
+				int last = (index+1)*units/stripes;
+				for (int first = index*units/stripes; (first < last) && (ret == 0); first += bandunits) {
+					int count = std::min(bandunits, last-first);
+					if (kernel(offset(m_informat, src, 2*srcunit*first), band, m_width, 2*srcunit*count) != 0) {
+						ret = -1;
+						break;
+					}
+					YuvImage out = offset(V4L2_PIX_FMT_YUV420, dst, 2*unit*first);
+					libyuv::ScalePlane(band.m_plane[0], band.m_stride[0], m_width, 2*srcunit*count,
+							out.m_plane[0], out.m_stride[0], m_outwidth, 2*unit*count, m_filter);
+					for (int plane = 1; plane < 3; ++plane) {
+						libyuv::ScalePlane(band.m_plane[plane], band.m_stride[plane], cwidth, srcunit*count,
+								out.m_plane[plane], out.m_stride[plane], outcwidth, unit*count, m_filter);
+					}
+				}
+			};
+			if (stripes > 1) {
+				m_pool->run(stripes, run);
+			} else {
+				run(0);
+			}
+			return ret;
+		}
+
+		// I420 is scaled directly into the output, other formats are converted at
+		// the smallest size possible: to I420 before scaling, from I420 after
+		int convertScale(const char* in, unsigned int insize, const YuvImage & src, const YuvImage & dst, char* out) {
+			if ( (m_informat == V4L2_PIX_FMT_BGR32) && (m_outformat == V4L2_PIX_FMT_BGR32) && !m_transformed ) {
+				return libyuv::ARGBScale(src.m_plane[0], src.m_stride[0], m_width, m_height,
+						dst.m_plane[0], dst.m_stride[0], m_outwidth, m_outheight,
+						m_filter);
+			}
+			const YuvImage & scaled = (canonical(m_outformat) == V4L2_PIX_FMT_YUV420) ? dst : m_scaled;
+			int ret = 0;
+			if (m_bands) {
+				ret = this->convertScaleBands(src, scaled);
+			} else if ( (canonical(m_informat) != V4L2_PIX_FMT_YUV420) || m_transformed ) {
+				ret = this->toI420(in, insize, src, m_i420);
+				if (ret == 0) {
+					ret = this->scaleI420(m_i420, scaled);
+				}
+			} else {
+				ret = this->scaleI420(src, scaled);
+			}
+			if ( (ret == 0) && (&scaled == &m_scaled) ) {
+				ret = this->fromI420(m_scaled, out, m_outwidth, m_outheight);
+			}
+			return ret;
+		}
+
+		// YV12 has the same layout than I420 with U and V swapped
+		static int canonical(int format) {
+			return (format == V4L2_PIX_FMT_YVU420) ? V4L2_PIX_FMT_YUV420 : format;
+		}
+
+		static Kernel findKernel(int informat, int outformat) {
+			// BGR32 is the byte order of libyuv ARGB, BGR24 the one of libyuv RGB24
+			static const struct { int m_in; int m_out; Kernel m_kernel; } kernels[] = {
+				{ V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::YUY2ToI420(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUV422P, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::YUY2ToI422(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::YUY2ToNV12(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], w, h); } },
+				{ V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_BGR32, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::YUY2ToARGB(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], w, h); } },
+
+				{ V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::UYVYToI420(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUV422P, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::UYVYToI422(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::UYVYToNV12(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], w, h); } },
+				{ V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_BGR32, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::UYVYToARGB(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], w, h); } },
+
+				{ V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::NV12ToI420(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_BGR32, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::NV12ToARGB(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_NV21, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::NV21ToI420(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420Copy(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUYV, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToYUY2(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_UYVY, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToUYVY(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_NV12, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToNV12(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_NV21, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToNV21(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_BGR32, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToARGB(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_BGR24, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I420ToRGB24(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+
+				{ V4L2_PIX_FMT_YUV422P, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I422ToI420(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_YUV422P, V4L2_PIX_FMT_YUYV, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I422ToYUY2(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_YUV422P, V4L2_PIX_FMT_UYVY, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I422ToUYVY(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_YUV422P, V4L2_PIX_FMT_BGR32, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::I422ToARGB(s.m_plane[0], s.m_stride[0], s.m_plane[1], s.m_stride[1], s.m_plane[2], s.m_stride[2], d.m_plane[0], d.m_stride[0], w, h); } },
+
+				{ V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_YUV420, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::ARGBToI420(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], d.m_plane[2], d.m_stride[2], w, h); } },
+				{ V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_NV12, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::ARGBToNV12(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], d.m_plane[1], d.m_stride[1], w, h); } },
+				{ V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_YUYV, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::ARGBToYUY2(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], w, h); } },
+				{ V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_UYVY, [](const YuvImage & s, const YuvImage & d, int w, int h) {
+					return libyuv::ARGBToUYVY(s.m_plane[0], s.m_stride[0], d.m_plane[0], d.m_stride[0], w, h); } },
+			};
+			for (unsigned int i = 0; i < sizeof(kernels)/sizeof(kernels[0]); ++i) {
+				if ( (kernels[i].m_in == canonical(informat)) && (kernels[i].m_out == canonical(outformat)) ) {
+					return kernels[i].m_kernel;
+				}
+			}
+			return NULL;
+		}
+
+	private:
+		int                 m_informat;
+		int                 m_outformat;
+		int                 m_width;
+		int                 m_height;
+		int                 m_outwidth;
+		int                 m_outheight;
+		libyuv::FilterMode  m_filter;
+		YuvTransform        m_transform;
+		bool                m_transformed;
+		int                 m_twidth;
+		int                 m_theight;
+		bool                m_scale;
+		Kernel              m_kernel;
+		bool                m_bands;
+		std::string         m_path;
+		std::vector<uint8>  m_i420buffer;
+		YuvImage            m_i420;
+		std::vector<uint8>  m_scaledbuffer;
+		YuvImage            m_scaled;
+		std::vector< std::vector<uint8> > m_bandbuffers;
+		int                 m_stripes;
+		std::unique_ptr<WorkerPool> m_pool;
+
+		// bytes of I420 rows converted at once, about what stays in the L2 cache
+		static const int BAND_SIZE = 256*1024;
+};
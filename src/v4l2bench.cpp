@@ -0,0 +1,438 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** v4l2bench.cpp
+**
+** Encode synthetic or file frames with each encoder -> report performance as JSON
+**
+** -------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <linux/videodev2.h>
+#include <signal.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <list>
+
+#include "logger.h"
+
+#include "V4l2Device.h"
+
+#include "encoderfactory.h"
+#ifdef HAVE_JPEG
+#include "jpegdecoder.h"
+#endif
+
+int stop=0;
+
+/* ---------------------------------------------------------------------------
+**  SIGINT handler
+** -------------------------------------------------------------------------*/
+void sighandler(int)
+{
+       printf("SIGINT\n");
+       stop =1;
+}
+
+// discard the compressed frames, only count them
+class NullSink : public FrameSink {
+	public:
+		NullSink() : m_bytes(0) {}
+
+		int write(char*, unsigned int size) {
+			m_bytes += size;
+			return size;
+		}
+
+		unsigned long long m_bytes;
+};
+
+// seconds of the given clock
+double getTime(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// moving pattern with some noise, so the encoders cannot skip everything
+void getFrame(std::vector<uint8> & buffer, int width, int height, int i)
+{
+	YuvImage image;
+	buffer.resize(YuvConverter::layout(V4L2_PIX_FMT_YUV420, width, height, NULL, image));
+	YuvConverter::layout(V4L2_PIX_FMT_YUV420, width, height, buffer.data(), image);
+	unsigned int seed = i;
+	for (int y=0; y<height; y++) {
+		uint8* line = image.m_plane[0] + y*image.m_stride[0];
+		for (int x=0; x<width; x++) {
+			seed = seed*1103515245 + 12345;
+			line[x] = x + y + i*3 + ((seed >> 16) & 0x7);
+		}
+	}
+	for (int y=0; y<(height+1)/2; y++) {
+		uint8* u = image.m_plane[1] + y*image.m_stride[1];
+		uint8* v = image.m_plane[2] + y*image.m_stride[2];
+		for (int x=0; x<(width+1)/2; x++) {
+			u[x] = 128 + y + i*2;
+			v[x] = 64 + x + i*5;
+		}
+	}
+}
+
+// frames in the input format, from a raw file or generated
+bool loadFrames(std::vector< std::vector<char> > & frames, const std::string & filename, int format, int width, int height, int count)
+{
+	YuvImage image;
+	unsigned int frameSize = YuvConverter::layout(format, width, height, NULL, image);
+	if (frameSize == 0) {
+		LOG(WARN) << "unsupported input format:" << V4l2Device::fourcc(format);
+		return false;
+	}
+	if (!filename.empty()) {
+		std::ifstream is(filename.c_str(), std::ios::binary);
+		std::vector<char> frame(frameSize);
+		while ( ((int)frames.size() < count) && is.read(frame.data(), frameSize) ) {
+			frames.push_back(frame);
+		}
+		if (frames.empty()) {
+			LOG(WARN) << "no frame of " << frameSize << " bytes in " << filename;
+			return false;
+		}
+	} else {
+		std::unique_ptr<YuvConverter> converter;
+		if (format != V4L2_PIX_FMT_YUV420) {
+			converter.reset(new YuvConverter(V4L2_PIX_FMT_YUV420, format, width, height));
+		}
+		std::vector<uint8> i420;
+		for (int i=0; i<count; ++i) {
+			getFrame(i420, width, height, i);
+			std::vector<char> frame(frameSize);
+			if (converter) {
+				if (converter->convert((char*)i420.data(), i420.size(), frame.data(), frame.size()) < 0) {
+					return false;
+				}
+			} else {
+				memcpy(frame.data(), i420.data(), frameSize);
+			}
+			frames.push_back(frame);
+		}
+	}
+	return true;
+}
+
+struct BenchResult {
+	int                 m_format;
+	int                 m_frames;
+	std::vector<double> m_latency;
+	unsigned long long  m_bytes;
+	double              m_wall;
+	double              m_cpu;
+};
+
+// encode the frames with one encoder, the frames are cycled until count frames are encoded
+bool bench(int format, const std::vector< std::vector<char> > & frames, int informat, int width, int height, int count, const std::map<std::string,std::string> & opt, int verbose, BenchResult & result)
+{
+	Encoder* encoder = EncoderFactory::Create(format, width, height, opt, verbose);
+	if (!encoder) {
+		LOG(WARN) << "Cannot create encoder " << V4l2Device::fourcc(format);
+		return false;
+	}
+	NullSink sink;
+	result.m_format = format;
+	result.m_latency.clear();
+	result.m_latency.reserve(count);
+
+	double cpu = getTime(CLOCK_PROCESS_CPUTIME_ID);
+	double wall = getTime(CLOCK_MONOTONIC);
+	for (int i=0; (i<count) && !stop; ++i) {
+		const std::vector<char> & frame = frames[i % frames.size()];
+		double start = getTime(CLOCK_MONOTONIC);
+		encoder->convertEncodeWrite(frame.data(), frame.size(), informat, &sink);
+		result.m_latency.push_back(getTime(CLOCK_MONOTONIC) - start);
+	}
+	encoder->flush(&sink);
+	result.m_wall = getTime(CLOCK_MONOTONIC) - wall;
+	result.m_cpu = getTime(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	result.m_frames = result.m_latency.size();
+	result.m_bytes = sink.m_bytes;
+	delete encoder;
+	return true;
+}
+
+// value of a sorted list at the given rank
+double percentile(const std::vector<double> & sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t idx = (size_t)(p*(sorted.size()-1) + 0.5);
+	return sorted[std::min(idx, sorted.size()-1)];
+}
+
+std::string toJson(const BenchResult & result, int informat, int width, int height, int fps)
+{
+	std::vector<double> sorted(result.m_latency);
+	std::sort(sorted.begin(), sorted.end());
+	double encodefps = result.m_wall > 0 ? result.m_frames/result.m_wall : 0;
+	double bitrate = result.m_frames ? result.m_bytes*8.0*fps/result.m_frames/1000 : 0;
+
+	std::ostringstream os;
+	os << "{\"format\":\"" << V4l2Device::fourcc(result.m_format) << "\""
+	   << ",\"input\":\"" << V4l2Device::fourcc(informat) << "\""
+	   << ",\"width\":" << width << ",\"height\":" << height
+	   << ",\"frames\":" << result.m_frames
+	   << ",\"fps\":" << encodefps
+	   << ",\"latency_ms\":{\"p50\":" << percentile(sorted, 0.5)*1000
+	   << ",\"p99\":" << percentile(sorted, 0.99)*1000
+	   << ",\"max\":" << (sorted.empty() ? 0 : sorted.back()*1000) << "}"
+	   << ",\"bytes\":" << result.m_bytes
+	   << ",\"bitrate_kbps\":" << bitrate
+	   << ",\"cpu_s\":" << result.m_cpu
+	   << ",\"wall_s\":" << result.m_wall
+	   << ",\"cpu_load\":" << (result.m_wall > 0 ? result.m_cpu/result.m_wall : 0)
+	   << "}";
+	return os.str();
+}
+
+#ifdef HAVE_JPEG
+// decode a 4:2:0 JPEG at 1/scale and compare with the full decoding scaled by libyuv, the IDCT scaling is close to a box filter
+template <typename Decoder>
+bool checkScaledDecode(const char* name, const std::vector<char> & jpeg, int width, int height, std::ostream & os, const char* & separator)
+{
+	Decoder full(V4L2_PIX_FMT_YUV420, 1);
+	std::vector<unsigned char> reference;
+	if (full.decode((const unsigned char*)jpeg.data(), jpeg.size(), reference) == 0) {
+		LOG(WARN) << name << " cannot decode the reference frame";
+		return false;
+	}
+	bool ok = true;
+	for (int scale : {2, 4, 8}) {
+		int outwidth = (width + scale - 1)/scale;
+		int outheight = (height + scale - 1)/scale;
+		YuvImage image;
+		std::vector<char> expected(YuvConverter::layout(V4L2_PIX_FMT_YUV420, outwidth, outheight, NULL, image));
+		YuvConverter scaler(V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUV420, width, height, outwidth, outheight);
+		scaler.convert((const char*)reference.data(), reference.size(), expected.data(), expected.size());
+
+		Decoder decoder(V4L2_PIX_FMT_YUV420, scale);
+		std::vector<unsigned char> out;
+		unsigned int size = decoder.decode((const unsigned char*)jpeg.data(), jpeg.size(), out);
+		double diff = 0;
+		int maxdiff = 0;
+		if (size == expected.size()) {
+			for (unsigned int i = 0; i < size; ++i) {
+				int d = abs(out[i] - (unsigned char)expected[i]);
+				diff += d;
+				maxdiff = std::max(maxdiff, d);
+			}
+			diff /= size;
+		}
+		bool same = (size == expected.size()) && (diff <= 2.0);
+		ok = ok && same;
+		os << separator << "{\"check\":\"jpeg_scaled_decode\",\"decoder\":\"" << name << "\",\"scale\":" << scale
+		   << ",\"size\":" << size << ",\"expected_size\":" << expected.size()
+		   << ",\"mean_diff\":" << diff << ",\"max_diff\":" << maxdiff << ",\"ok\":" << (same ? "true" : "false") << "}";
+		separator = ",\n";
+	}
+	return ok;
+}
+
+// encode a generated frame to JPEG and check the scaled decoding of each decoder
+bool checkJpegDecode(int width, int height, const std::map<std::string,std::string> & opt, int verbose, std::ostream & os)
+{
+	// the chroma of 1/8 must be an exact box, otherwise libyuv does not sample at the same positions as the IDCT
+	width = std::max(16, width & ~15);
+	height = std::max(16, height & ~15);
+	Encoder* encoder = EncoderFactory::Create(V4L2_PIX_FMT_JPEG, width, height, opt, verbose);
+	if (!encoder) {
+		return false;
+	}
+	std::vector<uint8> frame;
+	getFrame(frame, width, height, 0);
+	std::vector<char> jpeg;
+	BufferSink sink(jpeg);
+	encoder->convertEncodeWrite((const char*)frame.data(), frame.size(), V4L2_PIX_FMT_YUV420, &sink);
+	encoder->flush(&sink);
+	delete encoder;
+
+	bool ok = true;
+	const char* separator = "";
+	os << "[" << std::endl;
+	ok = checkScaledDecode<JpegDecoder>("libjpeg", jpeg, width, height, os, separator) && ok;
+#ifdef HAVE_TURBOJPEG
+	ok = checkScaledDecode<TurboJpegDecoder>("turbojpeg", jpeg, width, height, os, separator) && ok;
+#endif
+	os << std::endl << "]" << std::endl;
+	return ok;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+	int verbose=0;
+	int width = 640;
+	int height = 480;
+	int fps = 25;
+	int count = 300;
+	int loop = 16;
+	std::string strinformat = "YUYV";
+	std::string strformats;
+	std::string filename;
+	std::string outname;
+	bool checkDecode = false;
+	std::map<std::string,std::string> opt;
+	opt["VBR"] = "1000";
+	opt["GOP"] = "25";
+
+	int c = 0;
+	while ((c = getopt (argc, argv, "hv::" "f:i:W:H:n:l:r:o:" "C:V:Q:F:G:q:d:S:" "t:s:L:P:T:" "j:" "J")) != -1)
+	{
+		switch (c)
+		{
+			case 'v':	verbose = 1; if (optarg && *optarg=='v') verbose++;  break;
+
+			case 'f':	strformats  = optarg; break;
+			case 'i':	strinformat = optarg; break;
+			case 'W':	width       = atoi(optarg); break;
+			case 'H':	height      = atoi(optarg); break;
+			case 'n':	count       = atoi(optarg); break;
+			case 'l':	loop        = atoi(optarg); break;
+			case 'r':	fps         = atoi(optarg); break;
+			case 'o':	outname     = optarg; break;
+
+			// parameters for VPx/H26x
+			case 'G':	opt["GOP"] = optarg; break;
+			case 'C':	opt["CBR"] = optarg; break;
+			case 'V':	opt["VBR"] = optarg; break;
+			case 'Q':	opt["RC_CQP"] = optarg; break;
+			case 'F':	opt["RC_CRF"] = optarg; break;
+
+			// parameters for x264
+			case 't':	opt["THREADS"] = optarg; break;
+			case 's':	opt["SLICED_THREADS"] = optarg; break;
+			case 'L':	opt["LOOKAHEAD_THREADS"] = optarg; break;
+			case 'P':	opt["PRESET"] = optarg; break;
+			case 'T':	opt["TUNE"] = optarg; break;
+
+			// parameters for JPEG
+			case 'q':	opt["QUALITY"] = optarg; break;
+			case 'd':	opt["DRI"] = optarg; break;
+			case 'S':	opt["SLICES"] = optarg; break;
+
+			case 'j':	opt["STRIPES"] = optarg; break;
+			case 'J':	checkDecode = true; break;
+
+			case 'h':
+			{
+				std::cout << argv[0] << " [-v[v]] [-f format,...] [-i fourcc] [-W width] [-H height] [-n frames] [-o json_file] [raw_file]" << std::endl;
+				std::cout << "\t -v                   : verbose " << std::endl;
+				std::cout << "\t -vv                  : very verbose " << std::endl;
+
+				std::cout << "\t -f format,...        : encoders to benchmark (default all supported)" << std::endl;
+				std::cout << "\t -i fourcc            : input format (default " << strinformat << ")" << std::endl;
+				std::cout << "\t -W width             : frame width (default " << width << ")" << std::endl;
+				std::cout << "\t -H height            : frame height (default " << height << ")" << std::endl;
+				std::cout << "\t -n frames            : frames encoded with each encoder (default " << count << ")" << std::endl;
+				std::cout << "\t -l frames            : distinct frames kept in memory and cycled (default " << loop << ")" << std::endl;
+				std::cout << "\t -r fps               : framerate used to compute the bitrate (default " << fps << ")" << std::endl;
+
+				std::cout << "\t -C bitrate           : target CBR bitrate" << std::endl;
+				std::cout << "\t -V bitrate           : target VBR bitrate" << std::endl;
+
+				std::cout << "\t -t threads           : x264 threads (0 for auto, default 1)" << std::endl;
+				std::cout << "\t -s 0|1               : x264 frame threads (0) or sliced threads with one frame latency (1)" << std::endl;
+				std::cout << "\t -L threads           : x264 lookahead threads" << std::endl;
+				std::cout << "\t -P preset            : x264 preset (default ultrafast)" << std::endl;
+				std::cout << "\t -T tune              : x264 tune (default zerolatency)" << std::endl;
+
+				std::cout << "\t -q quality           : JPEG quality" << std::endl;
+				std::cout << "\t -S slices            : JPEG slices encoded in parallel with libjpeg, even when TurboJPEG is available (default 1)" << std::endl;
+				std::cout << "\t -j stripes           : horizontal stripes converted to I420 in parallel (default 1)" << std::endl;
+
+				std::cout << "\t -J                   : check the reduced size JPEG decoding against a full decoding scaled by libyuv, instead of benchmarking" << std::endl;
+				std::cout << "\t -o json_file         : write the results to this file (default stdout)" << std::endl;
+				std::cout << "\t raw_file             : frames in the input format, cycled (default generated pattern)" << std::endl;
+				exit(0);
+			}
+		}
+	}
+	if (optind<argc)
+	{
+		filename = argv[optind];
+		optind++;
+	}
+
+	// initialize log4cpp
+	initLogger(verbose);
+
+	std::list<int> formats;
+	if (strformats.empty()) {
+		formats = EncoderFactory::SupportedFormat();
+	} else {
+		std::istringstream is(strformats);
+		std::string strformat;
+		while (std::getline(is, strformat, ',')) {
+			formats.push_back(V4l2Device::fourcc(strformat.c_str()));
+		}
+	}
+	int informat = V4l2Device::fourcc(strinformat.c_str());
+
+	std::vector< std::vector<char> > frames;
+	if ( (count <= 0) || !loadFrames(frames, filename, informat, width, height, std::min(count, std::max(1, loop))) ) {
+		return -1;
+	}
+	LOG(NOTICE) << "Benchmark " << formats.size() << " encoders on " << count << " frames " << strinformat << " " << width << "x" << height;
+
+	signal(SIGINT,sighandler);
+
+	std::ofstream file;
+	if (!outname.empty()) {
+		file.open(outname.c_str());
+		if (!file.is_open()) {
+			LOG(WARN) << "Cannot open " << outname << " " << strerror(errno);
+			return -1;
+		}
+	}
+	std::ostream & os = file.is_open() ? file : std::cout;
+
+	if (checkDecode) {
+#ifdef HAVE_JPEG
+		return checkJpegDecode(width, height, opt, verbose, os) ? 0 : 1;
+#else
+		LOG(WARN) << "JPEG support is not built";
+		return -1;
+#endif
+	}
+
+	int ret = 0;
+	os << "[" << std::endl;
+	const char* separator = "";
+	for (int format : formats) {
+		if (stop) {
+			break;
+		}
+		BenchResult result;
+		if (bench(format, frames, informat, width, height, count, opt, verbose, result)) {
+			os << separator << toJson(result, informat, width, height, fps);
+			separator = ",\n";
+		} else {
+			ret = -1;
+		}
+	}
+	os << std::endl << "]" << std::endl;
+
+	return ret;
+}
@@ -16,25 +16,324 @@
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 
+#include <stdio.h>
+
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <atomic>
+
 #include "logger.h"
 
 #include "V4l2Device.h"
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
+#include "devicefactory.h"
 
 #include "encoderfactory.h"
+#include "transformencoder.h"
+#include "spscqueue.h"
+#include "mmapcapture.h"
+#include "mmapoutput.h"
+#include "workerpool.h"
+#include "latency.h"
+#include "metrics.h"
+#include "realtime.h"
+
+// -----------------------------------------
+//    timing of the dequeue, convert, encode and write stages, the capture jitter and the counters
+// -----------------------------------------
+struct CompressStats {
+	CompressStats(const std::map<std::string,std::string>& opt, uint64_t interval)
+		: m_stats((opt.find("STATS_PERIOD") != opt.end()) ? atoi(opt.at("STATS_PERIOD").c_str()) : 0, (opt.find("STATS_FILE") != opt.end()) ? opt.at("STATS_FILE") : "")
+		, m_dequeue(m_stats.add("dequeue"))
+		, m_convert(m_stats.add("convert"))
+		, m_encode(m_stats.add("encode"))
+		, m_write(m_stats.add("write"))
+		, m_jitter(m_stats.add("jitter"))
+		, m_jitterMeter(m_jitter, interval)
+		, m_metrics(&m_stats)
+		, m_server(m_metrics, (opt.find("METRICS") != opt.end()) ? opt.at("METRICS") : "") {
+		m_metrics.setFrameInterval(interval);
+		LOG(NOTICE) << "Frame interval:" << interval/1e6 << "ms";
+	}
+
+	// once all the stages are added
+	void start() {
+		m_stats.start();
+		m_server.start();
+	}
+
+	// dequeue the next capture buffer, or only the newest one when latest is set, the older ones are dropped
+	int dequeue(MmapCapture & mmapCapture, CaptureBuffer & capture, bool latest) {
+		if (!latest) {
+			return mmapCapture.dequeue(capture);
+		}
+		unsigned int dropped = 0;
+		int rsize = mmapCapture.dequeueLatest(capture, dropped);
+		if (dropped) {
+			m_metrics.in(dropped);
+			m_metrics.drop(dropped);
+			LOG(DEBUG) << "Dropped " << dropped << " older frames";
+		}
+		return rsize;
+	}
+
+	// encode a frame, the conversion is recorded apart if convert is given
+	// the writes are recorded if write is given, otherwise the sink is not the output device
+	void encode(Encoder* encoder, const char* buffer, unsigned int size, int format, FrameSink* sink, LatencyHistogram* convert, LatencyHistogram* write) {
+		TimedSink timedSink(sink);
+		uint64_t start = monotonicNow();
+		encoder->convertEncodeWrite(buffer, size, format, &timedSink);
+		uint64_t elapsed = monotonicNow() - start;
+		uint64_t writeTime = timedSink.takeElapsed();
+		uint64_t convertTime = convert ? std::min(encoder->getConvertTime(), elapsed - writeTime) : 0;
+		if (convert) {
+			convert->record(convertTime);
+		}
+		m_encode.record(elapsed - writeTime - convertTime);
+		if (write) {
+			write->record(writeTime);
+			int bytes = timedSink.takeBytes();
+			if (bytes > 0) {
+				m_metrics.out(bytes);
+			}
+		}
+	}
+
+	LatencyStats       m_stats;
+	LatencyHistogram & m_dequeue;
+	LatencyHistogram & m_convert;
+	LatencyHistogram & m_encode;
+	LatencyHistogram & m_write;
+	LatencyHistogram & m_jitter;
+	JitterMeter        m_jitterMeter;
+	Metrics            m_metrics;
+	MetricsServer      m_server;
+};
+
+// -----------------------------------------
+//    frame slot of the pipeline queues
+// -----------------------------------------
+struct Frame {
+	Frame() : m_size(0) {}
+
+	// frame is either copied in m_buffer or still in the capture buffer
+	const char* data() const { return m_capture.m_data ? m_capture.m_data : m_buffer.data(); }
+
+	std::vector<char> m_buffer;
+	unsigned int      m_size;
+	CaptureBuffer     m_capture;
+	FrameInfo         m_info;
+};
+
+// -----------------------------------------
+//    keep only the latest frame, it needs the memory mapped buffers to drain the driver queue
+// -----------------------------------------
+bool latestMode(const std::map<std::string,std::string>& opt, const MmapCapture & mmapCapture) {
+	bool latest = (opt.find("LATEST") != opt.end());
+	if (latest && !mmapCapture.isReady()) {
+		LOG(WARN) << "Latest frame mode needs memory mapped capture buffers, all the frames are kept";
+		latest = false;
+	}
+	return latest;
+}
+
+// -----------------------------------------
+//    scheduling of the threads, the capture loop and the encoder threads can be set apart
+// -----------------------------------------
+Realtime realtimeMode(const std::map<std::string,std::string>& opt) {
+	Realtime realtime;
+	if (opt.find("SCHED") != opt.end())    realtime.parsePolicy(opt.at("SCHED"));
+	if (opt.find("AFFINITY") != opt.end()) realtime.parseAffinity(opt.at("AFFINITY"));
+	realtime.setLockMemory(opt.find("MLOCK") != opt.end());
+	return realtime;
+}
+
+// -----------------------------------------
+//    capture, compress, output in 3 threads linked by SPSC queues
+// -----------------------------------------
+void compressPipeline(V4l2Capture* videoCapture, MmapCapture & mmapCapture, Encoder* encoder, V4l2Output* videoOutput, int depth, bool latest, const Realtime & realtime, CompressStats & stats, std::atomic<bool> & stop) {
+	// frames queued for encoding keep their capture buffer, the driver need at least one to fill
+	int captureDepth = depth;
+	if ( mmapCapture.isReady() && (captureDepth >= (int)mmapCapture.getBufferCount()) ) {
+		captureDepth = std::max(1, (int)mmapCapture.getBufferCount()-1);
+		LOG(NOTICE) << "Capture queue depth limited to " << captureDepth; 
+	}
+	SpscQueue<Frame> captureQueue(captureDepth);
+	SpscQueue<Frame> outputQueue(depth);
+
+	// preallocate the slots
+	unsigned int bufferSize = videoCapture->getBufferSize();
+	if (!mmapCapture.isReady()) {
+		for (Frame & frame : captureQueue.slots()) {
+			frame.m_buffer.resize(bufferSize);
+		}
+	}
+	for (Frame & frame : outputQueue.slots()) {
+		frame.m_buffer.reserve(bufferSize);
+	}
+	int informat = videoCapture->getFormat();
+	stats.m_metrics.addQueue("capture", [&]() { return captureQueue.size(); }, captureQueue.capacity());
+	stats.m_metrics.addQueue("output", [&]() { return outputQueue.size(); }, outputQueue.capacity());
+
+	// the output buffers get the capture timestamp of the encoded frame
+	MmapOutput mmapOutput(videoOutput);
+	V4l2OutputSink outputSink(videoOutput, &mmapOutput);
+
+	std::thread captureThread([&]() {
+		realtime.apply("capture");
+		timeval tv;
+		while (!stop) 
+		{
+			Frame* frame = captureQueue.back();
+			if (!frame) {
+				waitQueue();
+				continue;
+			}
+			tv.tv_sec=1;
+			tv.tv_usec=0;
+			int ret = videoCapture->isReadable(&tv);
+			uint64_t start = monotonicNow();
+			if ( (ret == 1) && mmapCapture.isReady() )
+			{
+				int rsize = stats.dequeue(mmapCapture, frame->m_capture, latest);
+				if (rsize != -1)
+				{
+					stats.m_jitterMeter.tick(start);
+					stats.m_dequeue.recordSince(start);
+					stats.m_metrics.in();
+					frame->m_size = rsize;
+					captureQueue.push();
+				}
+				else if (errno != EAGAIN)
+				{
+					LOG(NOTICE) << "stop " << strerror(errno); 
+					stop=true;
+				}
+			}
+			else if (ret == 1)
+			{
+				int rsize = videoCapture->read(frame->m_buffer.data(), frame->m_buffer.size());
+				if (rsize == -1)
+				{
+					LOG(NOTICE) << "stop " << strerror(errno); 
+					stop=true;
+				}
+				else
+				{
+					stats.m_jitterMeter.tick(start);
+					stats.m_dequeue.recordSince(start);
+					stats.m_metrics.in();
+					frame->m_size = rsize;
+					captureQueue.push();
+				}
+			}
+			else if (ret == -1)
+			{
+				LOG(NOTICE) << "stop error:" << strerror(errno); 
+				stop=true;
+			}
+		}
+	});
+
+	std::thread encodeThread([&]() {
+		realtime.apply("encode");
+		while (!stop) 
+		{
+			Frame* in = captureQueue.front();
+			Frame* out = outputQueue.back();
+			if (!in || !out) {
+				waitQueue();
+				continue;
+			}
+
+			out->m_buffer.clear();
+			BufferSink sink(out->m_buffer, &out->m_info);
+			encoder->setFrameInfo(in->m_capture.m_info);
+			stats.encode(encoder, in->data(), in->m_size, informat, &sink, &stats.m_convert, NULL);
+			out->m_size = out->m_buffer.size();
+			if (in->m_capture.m_data) {
+				mmapCapture.requeue(in->m_capture);
+			}
+
+			captureQueue.pop();
+			outputQueue.push();
+			LOG(DEBUG) << "Encoded " << in->m_size << " " << out->m_size << " queues:" << captureQueue.size() << "/" << outputQueue.size(); 
+		}
+	});
+
+	std::thread outputThread([&]() {
+		realtime.apply("output");
+		while (!stop) 
+		{
+			Frame* frame = outputQueue.front();
+			if (!frame) {
+				waitQueue();
+				continue;
+			}
+			if (frame->m_size) {
+				uint64_t start = monotonicNow();
+				outputSink.setFrameInfo(frame->m_info);
+				int wsize = outputSink.write(frame->m_buffer.data(), frame->m_size);
+				stats.m_write.recordSince(start);
+				stats.m_metrics.written(wsize);
+				LOG(DEBUG) << "Copied size:" << wsize; 
+			}
+			stats.m_stats.frame();
+			outputQueue.pop();
+		}
+	});
+
+	captureThread.join();
+	encodeThread.join();
+	outputThread.join();
+	stats.m_metrics.removeQueues();
+
+	// give back the capture buffers still queued
+	while (Frame* frame = captureQueue.front()) {
+		if (frame->m_capture.m_data) {
+			mmapCapture.requeue(frame->m_capture);
+		}
+		captureQueue.pop();
+	}
+
+	// write the frames already encoded, then the ones delayed in the encoder
+	while (Frame* frame = outputQueue.front()) {
+		if (frame->m_size) {
+			outputSink.setFrameInfo(frame->m_info);
+			outputSink.write(frame->m_buffer.data(), frame->m_size);
+		}
+		outputQueue.pop();
+	}
+	encoder->flush(&outputSink);
+}
 
 // -----------------------------------------
 //    capture, compress, output 
 // -----------------------------------------
-int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, int & stop, int verbose=0) {
+int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, std::atomic<bool> & stop, int verbose=0) {
 	int ret = 0;
 
-	// init V4L2 output interface
+	// region of interest and orientation
 	int width = videoCapture->getWidth();
 	int height = videoCapture->getHeight();		
+	YuvTransform transform;
+	if (opt.find("CROP") != opt.end())   transform.parseCrop(opt.at("CROP"));
+	if (opt.find("ROTATE") != opt.end()) transform.parseRotation(opt.at("ROTATE"));
+	if (opt.find("FLIP") != opt.end())   transform.parseFlip(opt.at("FLIP"));
+	transform.resolve(width, height);
+	bool transformed = !transform.isIdentity(width, height);
+	if (transformed) {
+		width = transform.getOutputWidth();
+		height = transform.getOutputHeight();
+	}
+
+	// init V4L2 output interface
 	V4L2DeviceParameters outparam(out_devname.c_str(), outformat, width, height, 0, verbose);
-	V4l2Output* videoOutput = V4l2Output::create(outparam, ioTypeOut);
+	V4l2Output* videoOutput = DeviceFactory::CreateOutput(outparam, ioTypeOut);
 	if (videoOutput == NULL)
 	{	
 		LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
@@ -42,16 +341,46 @@ int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Acce
 	}
 	else
 	{		
+		CompressStats stats(opt, frameInterval(videoCapture->getFd()));
+		stats.start();
+
+		// the threads of the encoder get the encode settings
+		Realtime realtime = realtimeMode(opt);
+		realtime.lockMemory();
+		realtime.apply("encode");
 		Encoder* encoder = EncoderFactory::Create(outformat, width, height, opt, verbose);
+		if (encoder && transformed)
+		{
+			// crop and rotate while converting to I420, the encoder reads the result in place
+			int stripes = (opt.find("STRIPES") != opt.end()) ? std::stoi(opt.at("STRIPES")) : 1;
+			encoder = new TransformEncoder(encoder, videoCapture->getFormat(), videoCapture->getWidth(), videoCapture->getHeight(), transform, stripes);
+		}
 		if (!encoder)
 		{
 			LOG(WARN) << "Cannot create encoder " << V4l2Device::fourcc(outformat); 
 		}
+		else if (opt.find("PIPELINE") != opt.end())
+		{
+			MmapCapture mmapCapture(videoCapture);
+			bool latest = latestMode(opt, mmapCapture);
+			int depth = std::max(1, std::stoi(opt.at("PIPELINE")));
+			LOG(NOTICE) << "Start Compressing to " << out_devname << " with pipeline depth:" << depth;  					
+			compressPipeline(videoCapture, mmapCapture, encoder, videoOutput, depth, latest, realtime, stats, stop);
+			if (latest) {
+				LOG(NOTICE) << "frames dropped to keep the latest:" << stats.m_metrics.getDrops();
+			}
+
+			delete encoder;
+		}
 		else
 		{						
+			MmapCapture mmapCapture(videoCapture);
+			bool latest = latestMode(opt, mmapCapture);
+			MmapOutput mmapOutput(videoOutput);
+			V4l2OutputSink sink(videoOutput, &mmapOutput);
+			std::vector<char> buffer(mmapCapture.isReady() ? 0 : videoCapture->getBufferSize());
 			timeval tv;
-			timeval refTime;
-			timeval curTime;
+			realtime.apply("capture");
 
 			LOG(NOTICE) << "Start Compressing to " << out_devname;  					
 			
@@ -60,26 +389,44 @@ int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Acce
 				tv.tv_sec=1;
 				tv.tv_usec=0;
 				int ret = videoCapture->isReadable(&tv);
-				if (ret == 1)
+				uint64_t start = monotonicNow();
+				if ( (ret == 1) && mmapCapture.isReady() )
+				{
+					// encode in place from the capture buffer
+					CaptureBuffer capture;
+					int rsize = stats.dequeue(mmapCapture, capture, latest);
+					if (rsize != -1)
+					{
+						stats.m_jitterMeter.tick(start);
+						stats.m_dequeue.recordSince(start);
+						stats.m_metrics.in();
+						encoder->setFrameInfo(capture.m_info);
+						stats.encode(encoder, capture.m_data, rsize, videoCapture->getFormat(), &sink, &stats.m_convert, &stats.m_write);
+						stats.m_stats.frame();
+						mmapCapture.requeue(capture);
+					}
+					else if (errno != EAGAIN)
+					{
+						LOG(NOTICE) << "stop " << strerror(errno); 
+						stop=true;
+					}
+				}
+				else if (ret == 1)
 				{
-					gettimeofday(&refTime, NULL);	
-					char buffer[videoCapture->getBufferSize()];
-					int rsize = videoCapture->read(buffer, sizeof(buffer));
-					
-					gettimeofday(&curTime, NULL);												
-					timeval captureTime;
-					timersub(&curTime,&refTime,&captureTime);
-					refTime = curTime;
-					
-					encoder->convertEncodeWrite(buffer, rsize,videoCapture->getFormat(), videoOutput);
-
-					gettimeofday(&curTime, NULL);												
-					timeval endodeTime;
-					timersub(&curTime,&refTime,&endodeTime);
-					refTime = curTime;
-
-					LOG(DEBUG) << " captureTime:" << (captureTime.tv_sec*1000+captureTime.tv_usec/1000) 
-							<< " endodeTime:" << (endodeTime.tv_sec*1000+endodeTime.tv_usec/1000); 							
+					int rsize = videoCapture->read(buffer.data(), buffer.size());
+					if (rsize == -1)
+					{
+						LOG(NOTICE) << "stop " << strerror(errno); 
+						stop=true;
+					}
+					else
+					{
+						stats.m_jitterMeter.tick(start);
+						stats.m_dequeue.recordSince(start);
+						stats.m_metrics.in();
+						stats.encode(encoder, buffer.data(), rsize, videoCapture->getFormat(), &sink, &stats.m_convert, &stats.m_write);
+						stats.m_stats.frame();
+					}
 				}
 				else if (ret == -1)
 				{
@@ -87,6 +434,10 @@ int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Acce
 					stop=true;
 				}
 			}
+			encoder->flush(&sink);
+			if (latest) {
+				LOG(NOTICE) << "frames dropped to keep the latest:" << stats.m_metrics.getDrops();
+			}
 			
 			delete encoder;
 		}
@@ -96,3 +447,251 @@ int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Acce
 	return ret;
 }
 
+
+// -----------------------------------------
+//    simulcast : one output per rung, all encoded from the same capture
+// -----------------------------------------
+
+// an I420 image of the downscale pyramid, scaled from a bigger one
+struct Rendition {
+	Rendition(int width, int height) : m_width(width), m_height(height), m_size(0), m_source(-1) {
+		YuvImage image;
+		m_buffer.resize(YuvConverter::layout(V4L2_PIX_FMT_YUV420, width, height, NULL, image));
+	}
+
+	int                           m_width;
+	int                           m_height;
+	std::vector<char>             m_buffer;
+	int                           m_size;
+	int                           m_source;
+	std::unique_ptr<YuvConverter> m_scaler;
+};
+
+// an output device with its encoder
+struct Rung {
+	Rung() : m_format(0), m_width(0), m_height(0), m_rendition(0), m_videoOutput(NULL), m_mmapOutput(NULL), m_encoder(NULL) {}
+
+	std::string  m_devname;
+	int          m_format;
+	int          m_width;
+	int          m_height;
+	std::string  m_bitrate;
+	int          m_rendition;
+	V4l2Output*  m_videoOutput;
+	MmapOutput*  m_mmapOutput;
+	Encoder*     m_encoder;
+};
+
+// parse device[:format[:WxH[:bitrate]]]
+bool parseRung(const std::string & spec, int defaultFormat, Rung & rung) {
+	std::vector<std::string> fields;
+	size_t start = 0;
+	size_t pos = 0;
+	while ((pos = spec.find(':', start)) != std::string::npos) {
+		fields.push_back(spec.substr(start, pos-start));
+		start = pos+1;
+	}
+	fields.push_back(spec.substr(start));
+
+	rung.m_devname = fields[0];
+	rung.m_format = defaultFormat;
+	if ( (fields.size() > 1) && !fields[1].empty() ) {
+		rung.m_format = V4l2Device::fourcc(fields[1].c_str());
+	}
+	if ( (fields.size() > 2) && !fields[2].empty() ) {
+		if ( (sscanf(fields[2].c_str(), "%dx%d", &rung.m_width, &rung.m_height) != 2) || (rung.m_width <= 0) || (rung.m_height <= 0) ) {
+			return false;
+		}
+	}
+	if (fields.size() > 3) {
+		rung.m_bitrate = fields[3];
+	}
+	return !rung.m_devname.empty() && (fields.size() <= 4);
+}
+
+int simulcast(V4l2Capture* videoCapture, const std::list<std::string> & specs, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, std::atomic<bool> & stop, int verbose=0) {
+	int stripes = (opt.find("STRIPES") != opt.end()) ? std::stoi(opt.at("STRIPES")) : 1;
+
+	// full size I420 image, cropped and rotated
+	YuvTransform transform;
+	if (opt.find("CROP") != opt.end())   transform.parseCrop(opt.at("CROP"));
+	if (opt.find("ROTATE") != opt.end()) transform.parseRotation(opt.at("ROTATE"));
+	if (opt.find("FLIP") != opt.end())   transform.parseFlip(opt.at("FLIP"));
+	YuvConverter converter(videoCapture->getFormat(), V4L2_PIX_FMT_YUV420, videoCapture->getWidth(), videoCapture->getHeight(), 0, 0, libyuv::kFilterBox, transform);
+	converter.setStripes(stripes);
+	std::vector<Rendition*> renditions;
+	renditions.push_back(new Rendition(converter.getOutputWidth(), converter.getOutputHeight()));
+
+	// one rendition for each size, from the biggest to the smallest
+	std::vector<Rung> rungs;
+	for (const std::string & spec : specs) {
+		Rung rung;
+		if (!parseRung(spec, outformat, rung)) {
+			LOG(WARN) << "Cannot parse output:" << spec;
+			continue;
+		}
+		if (rung.m_width == 0) {
+			rung.m_width = renditions[0]->m_width;
+			rung.m_height = renditions[0]->m_height;
+		}
+		rungs.push_back(rung);
+	}
+	std::sort(rungs.begin(), rungs.end(), [](const Rung & a, const Rung & b) { return a.m_width*a.m_height > b.m_width*b.m_height; });
+	for (Rung & rung : rungs) {
+		int index = -1;
+		for (unsigned int i = 0; i < renditions.size(); ++i) {
+			if ( (renditions[i]->m_width == rung.m_width) && (renditions[i]->m_height == rung.m_height) ) {
+				index = i;
+			}
+		}
+		if (index == -1) {
+			// scale from the smallest rendition that is not smaller
+			Rendition* rendition = new Rendition(rung.m_width, rung.m_height);
+			rendition->m_source = 0;
+			for (unsigned int i = 0; i < renditions.size(); ++i) {
+				if ( (renditions[i]->m_width >= rung.m_width) && (renditions[i]->m_height >= rung.m_height) ) {
+					rendition->m_source = i;
+				}
+			}
+			Rendition* source = renditions[rendition->m_source];
+			rendition->m_scaler.reset(new YuvConverter(V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUV420, source->m_width, source->m_height, rung.m_width, rung.m_height));
+			rendition->m_scaler->setStripes(stripes);
+			index = renditions.size();
+			renditions.push_back(rendition);
+		}
+		rung.m_rendition = index;
+	}
+
+	// the threads of the encoders and of the pool get the encode settings, the reporting threads are started before
+	CompressStats stats(opt, frameInterval(videoCapture->getFd()));
+	LatencyHistogram & scale = stats.m_stats.add("scale");
+	stats.start();
+	Realtime realtime = realtimeMode(opt);
+	realtime.lockMemory();
+	realtime.apply("encode");
+
+	// init V4L2 output interfaces and encoders
+	std::vector<Rung> ready;
+	for (Rung & rung : rungs) {
+		std::map<std::string,std::string> rungOpt(opt);
+		rungOpt.erase("STRIPES");
+		if (!rung.m_bitrate.empty()) {
+			// the bitrate of the rung replaces the rate control of the command line
+			bool cbr = (opt.find("CBR") != opt.end());
+			rungOpt.erase(cbr ? "VBR" : "CBR");
+			rungOpt.erase("RC_CQP");
+			rungOpt.erase("RC_CRF");
+			rungOpt[cbr ? "CBR" : "VBR"] = rung.m_bitrate;
+		}
+		V4L2DeviceParameters outparam(rung.m_devname.c_str(), rung.m_format, rung.m_width, rung.m_height, 0, verbose);
+		rung.m_videoOutput = DeviceFactory::CreateOutput(outparam, ioTypeOut);
+		if (rung.m_videoOutput == NULL) {
+			LOG(WARN) << "Cannot create V4L2 output interface for device:" << rung.m_devname; 
+			continue;
+		}
+		rung.m_encoder = EncoderFactory::Create(rung.m_format, rung.m_width, rung.m_height, rungOpt, verbose);
+		if (rung.m_encoder == NULL) {
+			LOG(WARN) << "Cannot create encoder " << V4l2Device::fourcc(rung.m_format); 
+			delete rung.m_videoOutput;
+			continue;
+		}
+		rung.m_mmapOutput = new MmapOutput(rung.m_videoOutput);
+		LOG(NOTICE) << "Output " << rung.m_devname << " " << V4l2Device::fourcc(rung.m_format) << " " << rung.m_width << "x" << rung.m_height << " from rendition:" << rung.m_rendition;
+		ready.push_back(rung);
+	}
+	rungs.swap(ready);
+
+	int ret = 0;
+	if (rungs.empty()) {
+		ret = -1;
+	} else {
+		// the rungs are encoded in parallel, each by its own thread
+		WorkerPool pool(rungs.size());
+		realtime.apply("capture");
+		MmapCapture mmapCapture(videoCapture);
+		bool latest = latestMode(opt, mmapCapture);
+		std::vector<char> buffer(mmapCapture.isReady() ? 0 : videoCapture->getBufferSize());
+		timeval tv;
+
+		LOG(NOTICE) << "Start Compressing to " << rungs.size() << " outputs";  					
+		while (!stop) {
+			tv.tv_sec=1;
+			tv.tv_usec=0;
+			int ready = videoCapture->isReadable(&tv);
+			if (ready == -1) {
+				LOG(NOTICE) << "stop error:" << strerror(errno); 
+				stop=true;
+			} else if (ready == 1) {
+				// convert once, then build the pyramid
+				Rendition* base = renditions[0];
+				FrameInfo info;
+				uint64_t time = monotonicNow();
+				if (mmapCapture.isReady()) {
+					CaptureBuffer capture;
+					int rsize = stats.dequeue(mmapCapture, capture, latest);
+					if (rsize == -1) {
+						if (errno != EAGAIN) {
+							LOG(NOTICE) << "stop error:" << strerror(errno); 
+							stop=true;
+						}
+						continue;
+					}
+					stats.m_jitterMeter.tick(time);
+					time = stats.m_dequeue.recordSince(time);
+					stats.m_metrics.in();
+					info = capture.m_info;
+					base->m_size = converter.convert(capture.m_data, rsize, base->m_buffer.data(), base->m_buffer.size());
+					mmapCapture.requeue(capture);
+				} else {
+					int rsize = videoCapture->read(buffer.data(), buffer.size());
+					if (rsize == -1) {
+						LOG(NOTICE) << "stop error:" << strerror(errno); 
+						stop=true;
+						continue;
+					}
+					stats.m_jitterMeter.tick(time);
+					time = stats.m_dequeue.recordSince(time);
+					stats.m_metrics.in();
+					base->m_size = converter.convert(buffer.data(), rsize, base->m_buffer.data(), base->m_buffer.size());
+				}
+				time = stats.m_convert.recordSince(time);
+				if (base->m_size <= 0) {
+					stats.m_metrics.drop();
+					continue;
+				}
+				for (unsigned int i = 1; i < renditions.size(); ++i) {
+					Rendition* rendition = renditions[i];
+					Rendition* source = renditions[rendition->m_source];
+					rendition->m_size = rendition->m_scaler->convert(source->m_buffer.data(), source->m_size, rendition->m_buffer.data(), rendition->m_buffer.size());
+				}
+				scale.recordSince(time);
+
+				// the encoders read their rendition in place, the encode stage is recorded for each rung
+				pool.run(rungs.size(), [&](int index) {
+					Rung & rung = rungs[index];
+					Rendition* rendition = renditions[rung.m_rendition];
+					if (rendition->m_size > 0) {
+						V4l2OutputSink sink(rung.m_videoOutput, rung.m_mmapOutput);
+						rung.m_encoder->setFrameInfo(info);
+						stats.encode(rung.m_encoder, rendition->m_buffer.data(), rendition->m_size, V4L2_PIX_FMT_YUV420, &sink, NULL, &stats.m_write);
+					}
+				});
+				stats.m_stats.frame();
+			}
+		}
+		if (latest) {
+			LOG(NOTICE) << "frames dropped:" << stats.m_metrics.getDrops();
+		}
+		for (Rung & rung : rungs) {
+			V4l2OutputSink sink(rung.m_videoOutput, rung.m_mmapOutput);
+			rung.m_encoder->flush(&sink);
+			delete rung.m_encoder;
+			delete rung.m_mmapOutput;
+			delete rung.m_videoOutput;
+		}
+	}
+	for (Rendition* rendition : renditions) {
+		delete rendition;
+	}
+	return ret;
+}
@@ -14,22 +14,30 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <linux/videodev2.h>
+#include <sys/ioctl.h>
 #include <signal.h>
 
 #include <iostream>
 #include <map>
+#include <list>
+#include <atomic>
 
 #include "logger.h"
 
 #include "V4l2Access.h"
 #include "V4l2Capture.h"
+#include "devicefactory.h"
 
-extern int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, int & stop, int verbose);
+#include "yuvconverter.h"
+#include "realtime.h"
+
+extern int compress(V4l2Capture* videoCapture, const std::string& out_devname, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, std::atomic<bool> & stop, int verbose);
+extern int simulcast(V4l2Capture* videoCapture, const std::list<std::string> & specs, V4l2Access::IoType ioTypeOut, int outformat, const std::map<std::string,std::string>& opt, std::atomic<bool> & stop, int verbose);
 
 /* ---------------------------------------------------------------------------
 **  end condition
 ** -------------------------------------------------------------------------*/
-int stop=0;
+std::atomic<bool> stop(false);
 
 /* ---------------------------------------------------------------------------
 **  SIGINT handler
@@ -37,7 +45,7 @@ int stop=0;
 void sighandler(int)
 { 
        printf("SIGINT\n");
-       stop =1;
+       stop = true;
 }
 
 /* ---------------------------------------------------------------------------
@@ -54,9 +62,10 @@ int main(int argc, char* argv[])
 	std::map<std::string,std::string> opt;
 	opt["VBR"] = "1000";
 	std::string strformat = "VP80";
+	std::list<std::string> outputs;
 	opt["GOP"] = "25";
 	
-	while ((c = getopt (argc, argv, "hv::rw" "f:" "C:V:Q:F:G:q:d:")) != -1)
+	while ((c = getopt (argc, argv, "hv::rw" "f:" "C:V:Q:F:G:q:d:S:" "t:s:L:P:T:" "p:j:" "c:R:m:" "o:" "i:I:M:" "l" "x:a:k")) != -1)
 	{
 		switch (c)
 		{
@@ -71,9 +80,42 @@ int main(int argc, char* argv[])
 			case 'Q':	opt["RC_CQP"] = optarg; break;	
 			case 'F':	opt["RC_CRF"] = optarg; break;				
 
+			// parameters for x264
+			case 't':	opt["THREADS"] = optarg; break;
+			case 's':	opt["SLICED_THREADS"] = optarg; break;
+			case 'L':	opt["LOOKAHEAD_THREADS"] = optarg; break;
+			case 'P':	opt["PRESET"] = optarg; break;
+			case 'T':	opt["TUNE"] = optarg; break;
+
 			// parameters for JPEG
 			case 'q':	opt["QUALITY"] = optarg; break;
 			case 'd':	opt["DRI"] = optarg; break;	
+			case 'S':	opt["SLICES"] = optarg; break;
+			
+			// pipeline
+			case 'p':	opt["PIPELINE"] = optarg; break;
+			case 'j':	opt["STRIPES"] = optarg; break;
+
+			// region of interest and orientation
+			case 'c':	opt["CROP"] = optarg; break;
+			case 'R':	opt["ROTATE"] = optarg; break;
+			case 'm':	opt["FLIP"] = optarg; break;
+
+			// simulcast
+			case 'o':	outputs.push_back(optarg); break;
+
+			// latency statistics
+			case 'i':	opt["STATS_PERIOD"] = optarg; break;
+			case 'I':	opt["STATS_FILE"] = optarg; break;
+			case 'M':	opt["METRICS"] = optarg; break;
+
+			// latency bound
+			case 'l':	opt["LATEST"] = "1"; break;
+
+			// scheduling
+			case 'x':	opt["SCHED"] = optarg; break;
+			case 'a':	opt["AFFINITY"] = optarg; break;
+			case 'k':	opt["MLOCK"] = "1"; break;
 			
 			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;			
 			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;	
@@ -87,10 +129,36 @@ int main(int argc, char* argv[])
 				std::cout << "\t -V bitrate           : target VBR bitrate" << std::endl;
 				std::cout << "\t -f format            : format (default is VP80) " << std::endl;
 
+				std::cout << "\t -t threads           : x264 threads (0 for auto, default 1)" << std::endl;
+				std::cout << "\t -s 0|1               : x264 frame threads (0) or sliced threads with one frame latency (1)" << std::endl;
+				std::cout << "\t -L threads           : x264 lookahead threads" << std::endl;
+				std::cout << "\t -P preset            : x264 preset (default ultrafast)" << std::endl;
+				std::cout << "\t -T tune              : x264 tune (default zerolatency)" << std::endl;
+
+				std::cout << "\t -S slices            : JPEG slices encoded in parallel with libjpeg, even when TurboJPEG is available (default 1)" << std::endl;
+
+				std::cout << "\t -p depth             : capture, encode and output in separate threads with queues of depth frames" << std::endl;
+				std::cout << "\t -j stripes           : horizontal stripes converted to I420 in parallel (default 1)" << std::endl;
+
+				std::cout << "\t -c WxH+X+Y           : encode only this rectangle of the captured frame" << std::endl;
+				std::cout << "\t -R angle             : rotate by 0, 90, 180 or 270 degrees" << std::endl;
+				std::cout << "\t -m h|v|hv            : flip horizontally and/or vertically (before rotation)" << std::endl;
+
+				std::cout << "\t -o dev[:fmt[:WxH[:bitrate]]] : output rung, repeat for simulcast (replace dest_device)" << std::endl;
+				std::cout << "\t -l                   : encode only the latest captured frame, drop the older ones" << std::endl;
+
+				std::cout << "\t -x fifo|rr[:prio]    : real-time scheduling of the capture, encode and output threads" << std::endl;
+				std::cout << "\t -a cpus              : pin the threads to a CPU list (0,2-3), or capture=0:encode=1-3:output=0 per role" << std::endl;
+				std::cout << "\t -k                   : lock the memory to avoid page faults" << std::endl;
+
+				std::cout << "\t -i seconds           : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file              : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t -M [host:]port|unix:path : serve the counters in Prometheus format (localhost by default)" << std::endl;
+
 				std::cout << "\t -r                   : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w                   : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
-				std::cout << "\t source_device        : V4L2 capture device (default "<< in_devname << ")" << std::endl;
-				std::cout << "\t dest_device          : V4L2 capture device (default "<< out_devname << ")" << std::endl;
+				std::cout << "\t source_device        : V4L2 capture device or file:/pipe: stand-in (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t dest_device          : V4L2 output device or file:/pipe: stand-in (default "<< out_devname << ")" << std::endl;
 				exit(0);
 			}
 		}
@@ -106,6 +174,30 @@ int main(int argc, char* argv[])
 		optind++;
 	}
 
+	YuvTransform transform;
+	if ( (opt.find("CROP") != opt.end()) && !transform.parseCrop(opt["CROP"]) ) {
+		std::cout << "unsupported crop:" << opt["CROP"] << std::endl;
+		exit(1);
+	}
+	if ( (opt.find("ROTATE") != opt.end()) && !transform.parseRotation(opt["ROTATE"]) ) {
+		std::cout << "unsupported rotation:" << opt["ROTATE"] << std::endl;
+		exit(1);
+	}
+	if ( (opt.find("FLIP") != opt.end()) && !transform.parseFlip(opt["FLIP"]) ) {
+		std::cout << "unsupported flip:" << opt["FLIP"] << std::endl;
+		exit(1);
+	}
+
+	Realtime realtime;
+	if ( (opt.find("SCHED") != opt.end()) && !realtime.parsePolicy(opt["SCHED"]) ) {
+		std::cout << "unsupported scheduling:" << opt["SCHED"] << std::endl;
+		exit(1);
+	}
+	if ( (opt.find("AFFINITY") != opt.end()) && !realtime.parseAffinity(opt["AFFINITY"]) ) {
+		std::cout << "unsupported CPU list:" << opt["AFFINITY"] << std::endl;
+		exit(1);
+	}
+
 	int outformat = V4l2Device::fourcc(strformat.c_str());
 		
 	signal(SIGINT,sighandler);	
@@ -115,7 +207,7 @@ int main(int argc, char* argv[])
 
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname,0,0,0,0,verbose);
-	V4l2Capture* videoCapture = V4l2Capture::create(param, ioTypeIn);
+	V4l2Capture* videoCapture = DeviceFactory::CreateCapture(param, ioTypeIn);
 	
 	int ret = 0;
 	if (videoCapture == NULL)
@@ -125,7 +217,20 @@ int main(int argc, char* argv[])
 	}
 	else
 	{
-		ret = compress(videoCapture, out_devname, ioTypeOut, outformat, opt, stop, verbose);
+		// the encoders rate control use the capture frame rate
+		struct v4l2_streamparm parm;
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if ( (ioctl(videoCapture->getFd(), VIDIOC_G_PARM, &parm) == 0) && (parm.parm.capture.timeperframe.numerator != 0) ) {
+			opt["FPS"] = std::to_string(parm.parm.capture.timeperframe.denominator) + "/" + std::to_string(parm.parm.capture.timeperframe.numerator);
+			LOG(NOTICE) << "Capture frame rate:" << opt["FPS"];
+		}
+
+		if (outputs.empty()) {
+			ret = compress(videoCapture, out_devname, ioTypeOut, outformat, opt, stop, verbose);
+		} else {
+			ret = simulcast(videoCapture, outputs, ioTypeOut, outformat, opt, stop, verbose);
+		}
 		delete videoCapture;
 	}
 
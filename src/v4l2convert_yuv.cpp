@@ -26,6 +26,13 @@
 #include "V4l2Device.h"
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
+#include "devicefactory.h"
+
+#include "yuvconverter.h"
+#include "mmapcapture.h"
+#include "latency.h"
+#include "metrics.h"
+#include "realtime.h"
 
 int stop=0;
 
@@ -50,27 +57,95 @@ int main(int argc, char* argv[])
 	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
 	V4l2Access::IoType ioTypeOut = V4l2Access::IOTYPE_MMAP;
 	std::string outFormatStr = "YU12";
+	int outWidth = 0;
+	int outHeight = 0;
+	libyuv::FilterMode filter = libyuv::kFilterBox;
+	int stripes = 1;
+	YuvTransform transform;
+	int statsPeriod = 0;
+	std::string statsFile;
+	std::string metricsAddress;
+	bool latest = false;
+	Realtime realtime;
 	
-	while ((c = getopt (argc, argv, "hv::" "o:" "rw")) != -1)
+	while ((c = getopt (argc, argv, "hv::" "o:" "W:H:s:" "j:" "c:R:F:" "i:I:M:" "l" "rw" "x:a:k")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'h':
 			{
-				std::cout << argv[0] << " [-v[v]] [-r] [-w] [-o <format>] source_device dest_device" << std::endl;
+				std::cout << argv[0] << " [-v[v]] [-r] [-w] [-o <format>] [-W width] [-H height] [-s filter] [-j stripes] [-c WxH+X+Y] [-R angle] [-F h|v|hv] [-i seconds] [-I file] [-M address] [-l] [-x fifo|rr[:prio]] [-a cpus] [-k] source_device dest_device" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -o <format>   : output YUV format (default " << outFormatStr << ")" << std::endl;
+				std::cout << "\t -W width      : output width (default cropped capture width)" << std::endl;
+				std::cout << "\t -H height     : output height (default cropped capture height)" << std::endl;
+				std::cout << "\t -s filter     : scaling filter none|linear|bilinear|box (default box)" << std::endl;
+				std::cout << "\t -j stripes    : horizontal stripes converted in parallel (default 1)" << std::endl;
+				std::cout << "\t -c WxH+X+Y    : crop this rectangle of the captured frame" << std::endl;
+				std::cout << "\t -R angle      : rotate by 0, 90, 180 or 270 degrees" << std::endl;
+				std::cout << "\t -F h|v|hv     : flip horizontally and/or vertically (before rotation)" << std::endl;
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t -M [host:]port|unix:path : serve the counters in Prometheus format (localhost by default)" << std::endl;
+				std::cout << "\t -l            : convert only the latest captured frame, drop the older ones" << std::endl;
+				std::cout << "\t -x fifo|rr[:prio] : real-time scheduling of the capture loop and the stripe threads" << std::endl;
+				std::cout << "\t -a cpus       : pin the threads to a CPU list (0,2-3), or capture=0:encode=1-3 for the loop and the stripes" << std::endl;
+				std::cout << "\t -k            : lock the memory to avoid page faults" << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
-				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
-				std::cout << "\t dest_device   : V4L2 capture device (default "<< out_devname << ")" << std::endl;
+				std::cout << "\t source_device : V4L2 capture device or file:/pipe: stand-in (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t dest_device   : V4L2 output device or file:/pipe: stand-in (default "<< out_devname << ")" << std::endl;
 				exit(0);
 			}
 			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;			
 			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;	
 			case 'o':   outFormatStr = optarg ; break;
+			case 'W':   outWidth = atoi(optarg); break;
+			case 'H':   outHeight = atoi(optarg); break;
+			case 'j':   stripes = atoi(optarg); break;
+			case 'i':   statsPeriod = atoi(optarg); break;
+			case 'I':   statsFile = optarg; break;
+			case 'M':   metricsAddress = optarg; break;
+			case 'l':   latest = true; break;
+			case 'k':   realtime.setLockMemory(true); break;
+			case 'x':
+				if (!realtime.parsePolicy(optarg)) {
+					std::cout << "unsupported scheduling :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
+			case 'a':
+				if (!realtime.parseAffinity(optarg)) {
+					std::cout << "unsupported CPU list :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
+			case 'c':
+				if (!transform.parseCrop(optarg)) {
+					std::cout << "unsupported crop :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
+			case 'R':
+				if (!transform.parseRotation(optarg)) {
+					std::cout << "unsupported rotation :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
+			case 'F':
+				if (!transform.parseFlip(optarg)) {
+					std::cout << "unsupported flip :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
+			case 's':
+				if (!YuvConverter::parseFilter(optarg, filter)) {
+					std::cout << "unknown filter :" << optarg << std::endl;
+					exit(1);
+				}
+			break;
 			default:
 				std::cout << "option :" << c << " is unknown" << std::endl;
 				break;
@@ -97,7 +172,7 @@ int main(int argc, char* argv[])
 
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname, 0, 0, 0, 0,verbose);
-	V4l2Capture* videoCapture = V4l2Capture::create(param, ioTypeIn);
+	V4l2Capture* videoCapture = DeviceFactory::CreateCapture(param, ioTypeIn);
 	
 	if (videoCapture == NULL || videoCapture->getFormat() == 0)
 	{	
@@ -111,27 +186,51 @@ int main(int argc, char* argv[])
 				
 		// init V4L2 output interface
 		int outformat = v4l2_fourcc(outFormatStr[0], outFormatStr[1], outFormatStr[2], outFormatStr[3]);
-		V4L2DeviceParameters outparam(out_devname, outformat, videoCapture->getWidth(), videoCapture->getHeight(), 0, verbose);
-		V4l2Output* videoOutput = V4l2Output::create(outparam, ioTypeOut);
+		transform.resolve(width, height);
+		if (outWidth <= 0)  outWidth = transform.getOutputWidth();
+		if (outHeight <= 0) outHeight = transform.getOutputHeight();
+		V4L2DeviceParameters outparam(out_devname, outformat, outWidth, outHeight, 0, verbose);
+		V4l2Output* videoOutput = DeviceFactory::CreateOutput(outparam, ioTypeOut);
 		if (videoOutput == NULL)
 		{	
 			LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
 		}
 		else
 		{	
-			// check output size
-			if ( (videoOutput->getWidth() != width) || (videoOutput->getHeight() != height) )
-			{
-				LOG(WARN) << "Cannot rescale input:" << videoCapture->getWidth()  << "x" << videoCapture->getHeight() << " output:" << videoOutput->getWidth()  << "x" << videoOutput->getHeight(); 
-			}
-			else
 			{
-				// intermediate I420 image
-				uint8 i420_p0[width*height];
-				uint8 i420_p1[width*height/2];
-				uint8 i420_p2[width*height/2];
+				// scale when the output device does not use the cropped and rotated size
+				YuvConverter converter(informat, outformat, width, height, videoOutput->getWidth(), videoOutput->getHeight(), filter, transform);
+				std::vector<char> outBuffer(videoOutput->getBufferSize());
 				
 				timeval tv;
+				LatencyStats stats(statsPeriod, statsFile);
+				LatencyHistogram & dequeue = stats.add("dequeue");
+				LatencyHistogram & convert = stats.add("convert");
+				LatencyHistogram & write = stats.add("write");
+				LatencyHistogram & jitterStage = stats.add("jitter");
+				stats.start();
+				Metrics metrics(&stats);
+				MetricsServer server(metrics, metricsAddress);
+				server.start();
+
+				// the wakeups are compared to the capture frame interval
+				uint64_t interval = frameInterval(videoCapture->getFd());
+				metrics.setFrameInterval(interval);
+				JitterMeter jitter(jitterStage, interval);
+				LOG(NOTICE) << "Frame interval:" << interval/1e6 << "ms";
+
+				// the stripe threads get the encode settings, the loop the capture ones
+				realtime.lockMemory();
+				realtime.apply("encode");
+				converter.setStripes(stripes);
+				realtime.apply("capture");
+
+				// the latest frame is converted from the capture buffer, after the older ones are given back
+				MmapCapture mmapCapture(videoCapture);
+				if (latest && !mmapCapture.isReady()) {
+					LOG(WARN) << "Latest frame mode needs memory mapped capture buffers, all the frames are kept";
+					latest = false;
+				}
 				
 				LOG(NOTICE) << "Start Copying from " << in_devname << " to " << out_devname; 
 				signal(SIGINT,sighandler);				
@@ -148,34 +247,46 @@ int main(int argc, char* argv[])
 							bufferSize = width*height*3;
 						}
 						char inbuffer[bufferSize];
-						int rsize = videoCapture->read(inbuffer, sizeof(inbuffer));
-						if (rsize == -1)
+						char* data = inbuffer;
+						CaptureBuffer capture;
+						unsigned int dropped = 0;
+						uint64_t time = monotonicNow();
+						int rsize = -1;
+						if (latest) {
+							rsize = mmapCapture.dequeueLatest(capture, dropped);
+							data = (char*)capture.m_data;
+						} else {
+							rsize = videoCapture->read(inbuffer, sizeof(inbuffer));
+						}
+						if ( (rsize == -1) && (!latest || (errno != EAGAIN)) )
 						{
 							LOG(NOTICE) << "stop " << strerror(errno); 
 							stop=1;					
 						}
-						else
+						else if (rsize != -1)
 						{
-							libyuv::ConvertToI420((const uint8*)inbuffer, rsize,
-								i420_p0, width,
-								i420_p1, width/2,
-								i420_p2, width/2,
-								0, 0,
-								width, height,
-								width, height,
-								libyuv::kRotate0, informat);
-
-							char outBuffer[videoOutput->getBufferSize()];
-							libyuv::ConvertFromI420(i420_p0, width,
-									i420_p1, width/2,
-									i420_p2, width/2,
-									(uint8*)outBuffer, 0,
-									width, height,
-									outformat);
-							
-							
-							int wsize = videoOutput->write(outBuffer, sizeof(outBuffer));
-							LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
+							jitter.tick(time);
+							time = dequeue.recordSince(time);
+							metrics.in(dropped+1);
+							metrics.drop(dropped);
+							int wsize = 0;
+							if (converter.isPassthrough()) {
+								wsize = videoOutput->write(data, rsize);
+								write.recordSince(time);
+							} else {
+								int size = converter.convert(data, rsize, outBuffer.data(), outBuffer.size());
+								time = convert.recordSince(time);
+								if (size > 0) {
+									wsize = videoOutput->write(outBuffer.data(), size);
+									write.recordSince(time);
+								}
+							}
+							metrics.written(wsize);
+							stats.frame();
+							if (capture.m_data) {
+								mmapCapture.requeue(capture);
+							}
+							LOG(DEBUG) << "Copied " << rsize << " " << wsize << " dropped:" << dropped; 
 						}
 					}
 					else if (ret == -1)
@@ -184,6 +295,9 @@ int main(int argc, char* argv[])
 						stop=1;
 					}
 				}
+				if (latest) {
+					LOG(NOTICE) << "frames dropped to keep the latest:" << metrics.getDrops();
+				}
 			}
 			delete videoOutput;
 		}
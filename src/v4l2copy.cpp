@@ -24,6 +24,11 @@
 #include "V4l2Device.h"
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
+#include "devicefactory.h"
+#include "mmapcapture.h"
+#include "latency.h"
+#include "metrics.h"
+#include "realtime.h"
 
 int stop=0;
 
@@ -47,14 +52,26 @@ int main(int argc, char* argv[])
 	int c = 0;
 	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
 	V4l2Access::IoType ioTypeOut = V4l2Access::IOTYPE_MMAP;
+	int statsPeriod = 0;
+	std::string statsFile;
+	std::string metricsAddress;
+	bool latest = false;
+	Realtime realtime;
 	
-	while ((c = getopt (argc, argv, "hP:F:v::rw")) != -1)
+	while ((c = getopt (argc, argv, "hP:F:v::rw" "i:I:M:" "l" "x:a:k")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;			
 			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;			
+			case 'i':	statsPeriod = atoi(optarg); break;
+			case 'I':	statsFile = optarg; break;
+			case 'M':	metricsAddress = optarg; break;
+			case 'l':	latest = true; break;
+			case 'x':	if (!realtime.parsePolicy(optarg)) { std::cout << "unsupported scheduling:" << optarg << std::endl; exit(1); } break;
+			case 'a':	if (!realtime.parseAffinity(optarg)) { std::cout << "unsupported CPU list:" << optarg << std::endl; exit(1); } break;
+			case 'k':	realtime.setLockMemory(true); break;
 			case 'h':
 			{
 				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
@@ -62,8 +79,15 @@ int main(int argc, char* argv[])
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
-				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
-				std::cout << "\t dest_device   : V4L2 capture device (default "<< out_devname << ")" << std::endl;
+				std::cout << "\t -l            : copy only the latest captured frame, drop the older ones" << std::endl;
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t -M [host:]port|unix:path : serve the counters in Prometheus format (localhost by default)" << std::endl;
+				std::cout << "\t -x fifo|rr[:prio] : real-time scheduling of the copy thread" << std::endl;
+				std::cout << "\t -a cpus       : pin the copy thread to a CPU list (0,2-3)" << std::endl;
+				std::cout << "\t -k            : lock the memory to avoid page faults" << std::endl;
+				std::cout << "\t source_device : V4L2 capture device or file:/pipe: stand-in (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t dest_device   : V4L2 output device or file:/pipe: stand-in (default "<< out_devname << ")" << std::endl;
 				exit(0);
 			}
 		}
@@ -84,7 +108,7 @@ int main(int argc, char* argv[])
 
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname, 0, 0, 0, 0,verbose);
-	V4l2Capture* videoCapture = V4l2Capture::create(param, ioTypeIn);
+	V4l2Capture* videoCapture = DeviceFactory::CreateCapture(param, ioTypeIn);
 	
 	if (videoCapture == NULL)
 	{	
@@ -94,7 +118,7 @@ int main(int argc, char* argv[])
 	{
 		// init V4L2 output interface
 		V4L2DeviceParameters outparam(out_devname, videoCapture->getFormat(), videoCapture->getWidth(), videoCapture->getHeight(), 0,verbose);
-		V4l2Output* videoOutput = V4l2Output::create(outparam, ioTypeOut);
+		V4l2Output* videoOutput = DeviceFactory::CreateOutput(outparam, ioTypeOut);
 		if (videoOutput == NULL)
 		{	
 			LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
@@ -102,7 +126,32 @@ int main(int argc, char* argv[])
 		else
 		{		
 			timeval tv;
+			LatencyStats stats(statsPeriod, statsFile);
+			LatencyHistogram & dequeue = stats.add("dequeue");
+			LatencyHistogram & write = stats.add("write");
+			LatencyHistogram & jitterStage = stats.add("jitter");
+			stats.start();
+			Metrics metrics(&stats);
+			MetricsServer server(metrics, metricsAddress);
+			server.start();
+
+			// the wakeups are compared to the capture frame interval
+			uint64_t interval = frameInterval(videoCapture->getFd());
+			metrics.setFrameInterval(interval);
+			JitterMeter jitter(jitterStage, interval);
+			LOG(NOTICE) << "Frame interval:" << interval/1e6 << "ms";
+
+			// the latest frame is written from the capture buffer, after the older ones are given back
+			MmapCapture mmapCapture(videoCapture);
+			if (latest && !mmapCapture.isReady()) {
+				LOG(WARN) << "Latest frame mode needs memory mapped capture buffers, all the frames are kept";
+				latest = false;
+			}
 			
+			// the reporting threads are started, only the copy loop is real-time
+			realtime.lockMemory();
+			realtime.apply("capture");
+
 			LOG(NOTICE) << "Start Copying from " << in_devname << " to " << out_devname; 
 			signal(SIGINT,sighandler);				
 			while (!stop) 
@@ -110,9 +159,35 @@ int main(int argc, char* argv[])
 				tv.tv_sec=1;
 				tv.tv_usec=0;
 				int ret = videoCapture->isReadable(&tv);
-				if (ret == 1)
+				if ( (ret == 1) && latest )
+				{
+					CaptureBuffer capture;
+					unsigned int dropped = 0;
+					uint64_t time = monotonicNow();
+					int rsize = mmapCapture.dequeueLatest(capture, dropped);
+					if (rsize != -1)
+					{
+						jitter.tick(time);
+						time = dequeue.recordSince(time);
+						metrics.in(dropped+1);
+						metrics.drop(dropped);
+						int wsize = videoOutput->write((char*)capture.m_data, rsize);
+						write.recordSince(time);
+						metrics.written(wsize);
+						stats.frame();
+						mmapCapture.requeue(capture);
+						LOG(DEBUG) << "Copied " << rsize << " " << wsize << " dropped:" << dropped; 
+					}
+					else if (errno != EAGAIN)
+					{
+						LOG(NOTICE) << "stop " << strerror(errno); 
+						stop=1;
+					}
+				}
+				else if (ret == 1)
 				{
 					char buffer[videoCapture->getBufferSize()];
+					uint64_t time = monotonicNow();
 					int rsize = videoCapture->read(buffer, sizeof(buffer));
 					if (rsize == -1)
 					{
@@ -121,7 +196,13 @@ int main(int argc, char* argv[])
 					}
 					else
 					{
+						jitter.tick(time);
+						time = dequeue.recordSince(time);
+						metrics.in();
 						int wsize = videoOutput->write(buffer, rsize);
+						write.recordSince(time);
+						metrics.written(wsize);
+						stats.frame();
 						LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
 					}
 				}
@@ -131,6 +212,9 @@ int main(int argc, char* argv[])
 					stop=1;
 				}
 			}
+			if (latest) {
+				LOG(NOTICE) << "frames dropped to keep the latest:" << metrics.getDrops();
+			}
 			delete videoOutput;
 		}
 		delete videoCapture;
@@ -0,0 +1,493 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** v4l2daemon.cpp
+**
+** Run the capture -> convert/compress -> output pipelines listed in a file
+** with one epoll loop and worker threads shared by the pipelines
+**
+** -------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <signal.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "logger.h"
+
+#include "V4l2Device.h"
+#include "V4l2Capture.h"
+#include "V4l2Output.h"
+#include "devicefactory.h"
+
+#include "encoderfactory.h"
+#include "yuvconverter.h"
+#include "mmapcapture.h"
+#include "mmapoutput.h"
+#include "affinity.h"
+
+std::atomic<bool> stop(false);
+
+/* ---------------------------------------------------------------------------
+**  SIGINT handler
+** -------------------------------------------------------------------------*/
+void sighandler(int)
+{
+       printf("SIGINT\n");
+       stop = true;
+}
+
+// threads running the jobs of the pipelines that share the same CPU list
+class WorkerGroup {
+	public:
+		WorkerGroup(const std::string & cpus, int threads) : m_cpus(cpus), m_stop(false) {
+			for (int i = 0; i < threads; ++i) {
+				m_threads.push_back(std::thread(&WorkerGroup::loop, this));
+			}
+		}
+
+		// run the jobs already queued, then join the threads
+		~WorkerGroup() {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_cond.notify_all();
+			for (std::thread & thread : m_threads) {
+				thread.join();
+			}
+		}
+
+		void push(const std::function<void()> & job) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_jobs.push_back(job);
+			}
+			m_cond.notify_one();
+		}
+
+		int size() const { return m_threads.size(); }
+
+	private:
+		void loop() {
+			if (!m_cpus.empty()) {
+				setThreadAffinity(m_cpus);
+			}
+			while (true) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_cond.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+					if (m_jobs.empty()) {
+						return;
+					}
+					job = m_jobs.front();
+					m_jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+	private:
+		std::string                        m_cpus;
+		std::vector<std::thread>           m_threads;
+		std::mutex                         m_mutex;
+		std::condition_variable            m_cond;
+		std::deque< std::function<void()> > m_jobs;
+		bool                               m_stop;
+};
+
+// a capture device, its processing and its output device
+struct Pipeline {
+	Pipeline() : m_captureFormat(0), m_captureWidth(0), m_captureHeight(0), m_fps(0), m_format(0), m_width(0), m_height(0), m_latest(false)
+		, m_videoCapture(NULL), m_videoOutput(NULL), m_encoder(NULL), m_group(NULL), m_failed(false), m_frames(0), m_drops(0) {}
+
+	~Pipeline() {
+		delete m_encoder;
+		m_mmapOutput.reset();
+		m_mmapCapture.reset();
+		delete m_videoOutput;
+		delete m_videoCapture;
+	}
+
+	// configuration
+	std::string                        m_source;
+	std::string                        m_dest;
+	int                                m_captureFormat;
+	int                                m_captureWidth;
+	int                                m_captureHeight;
+	int                                m_fps;
+	int                                m_format;
+	int                                m_width;
+	int                                m_height;
+	bool                               m_latest;
+	std::string                        m_cpus;
+	std::map<std::string,std::string>  m_opt;
+
+	// devices and processing
+	V4l2Capture*                       m_videoCapture;
+	V4l2Output*                        m_videoOutput;
+	std::unique_ptr<MmapCapture>       m_mmapCapture;
+	std::unique_ptr<MmapOutput>        m_mmapOutput;
+	Encoder*                           m_encoder;
+	std::unique_ptr<YuvConverter>      m_converter;
+	std::vector<char>                  m_inBuffer;
+	std::vector<char>                  m_outBuffer;
+	WorkerGroup*                       m_group;
+
+	std::atomic<bool>                  m_failed;
+	std::atomic<unsigned long>         m_frames;
+	std::atomic<unsigned long>         m_drops;
+};
+
+// parse source dest [key=value ...], the unknown keys are given to the encoder in upper case
+bool parsePipeline(const std::string & line, Pipeline & pipeline) {
+	std::istringstream is(line);
+	if (!(is >> pipeline.m_source >> pipeline.m_dest)) {
+		return false;
+	}
+	std::string token;
+	while (is >> token) {
+		size_t pos = token.find('=');
+		std::string key = token.substr(0, pos);
+		std::string value = (pos == std::string::npos) ? "1" : token.substr(pos+1);
+		if (key == "capture") {
+			pipeline.m_captureFormat = V4l2Device::fourcc(value.c_str());
+		} else if (key == "capture_size") {
+			if (sscanf(value.c_str(), "%dx%d", &pipeline.m_captureWidth, &pipeline.m_captureHeight) != 2) {
+				return false;
+			}
+		} else if (key == "fps") {
+			pipeline.m_fps = atoi(value.c_str());
+		} else if (key == "format") {
+			pipeline.m_format = V4l2Device::fourcc(value.c_str());
+		} else if (key == "size") {
+			if (sscanf(value.c_str(), "%dx%d", &pipeline.m_width, &pipeline.m_height) != 2) {
+				return false;
+			}
+		} else if (key == "latest") {
+			pipeline.m_latest = (value != "0");
+		} else if (key == "cpu") {
+			cpu_set_t set;
+			if (!parseCpuList(value, set)) {
+				return false;
+			}
+			pipeline.m_cpus = value;
+		} else {
+			std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+			pipeline.m_opt[key] = value;
+		}
+	}
+	return true;
+}
+
+// open the devices and create the encoder or the converter
+bool openPipeline(Pipeline & pipeline, int verbose) {
+	V4L2DeviceParameters param(pipeline.m_source.c_str(), pipeline.m_captureFormat, pipeline.m_captureWidth, pipeline.m_captureHeight, pipeline.m_fps, verbose);
+	pipeline.m_videoCapture = DeviceFactory::CreateCapture(param, V4l2Access::IOTYPE_MMAP);
+	if (pipeline.m_videoCapture == NULL) {
+		LOG(WARN) << "Cannot create V4L2 capture interface for device:" << pipeline.m_source;
+		return false;
+	}
+	int informat = pipeline.m_videoCapture->getFormat();
+	int width = pipeline.m_videoCapture->getWidth();
+	int height = pipeline.m_videoCapture->getHeight();
+	int outformat = pipeline.m_format ? pipeline.m_format : informat;
+	int outwidth = pipeline.m_width ? pipeline.m_width : width;
+	int outheight = pipeline.m_height ? pipeline.m_height : height;
+
+	V4L2DeviceParameters outparam(pipeline.m_dest.c_str(), outformat, outwidth, outheight, 0, verbose);
+	pipeline.m_videoOutput = DeviceFactory::CreateOutput(outparam, V4l2Access::IOTYPE_MMAP);
+	if (pipeline.m_videoOutput == NULL) {
+		LOG(WARN) << "Cannot create V4L2 output interface for device:" << pipeline.m_dest;
+		return false;
+	}
+
+	std::list<int> encoders = EncoderFactory::SupportedFormat();
+	if (std::find(encoders.begin(), encoders.end(), outformat) != encoders.end()) {
+		// the encoders rate control use the capture frame rate
+		struct v4l2_streamparm parm;
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if ( (pipeline.m_opt.find("FPS") == pipeline.m_opt.end()) && (ioctl(pipeline.m_videoCapture->getFd(), VIDIOC_G_PARM, &parm) == 0) && (parm.parm.capture.timeperframe.numerator != 0) ) {
+			pipeline.m_opt["FPS"] = std::to_string(parm.parm.capture.timeperframe.denominator) + "/" + std::to_string(parm.parm.capture.timeperframe.numerator);
+		}
+		pipeline.m_encoder = EncoderFactory::Create(outformat, outwidth, outheight, pipeline.m_opt, verbose);
+		if (pipeline.m_encoder == NULL) {
+			LOG(WARN) << "Cannot create encoder " << V4l2Device::fourcc(outformat);
+			return false;
+		}
+		if ( (outwidth != width) || (outheight != height) ) {
+			// scale to I420, the encoder reads the result in place
+			pipeline.m_converter.reset(new YuvConverter(informat, V4L2_PIX_FMT_YUV420, width, height, outwidth, outheight));
+		}
+	} else if ( (outformat != informat) || (outwidth != width) || (outheight != height) ) {
+		pipeline.m_converter.reset(new YuvConverter(informat, outformat, width, height, outwidth, outheight));
+	}
+	if (pipeline.m_converter) {
+		pipeline.m_outBuffer.resize(std::max(pipeline.m_videoOutput->getBufferSize(), (unsigned int)outwidth*outheight*3));
+	}
+
+	pipeline.m_mmapCapture.reset(new MmapCapture(pipeline.m_videoCapture));
+	if (!pipeline.m_mmapCapture->isReady()) {
+		pipeline.m_inBuffer.resize(pipeline.m_videoCapture->getBufferSize());
+		if (pipeline.m_latest) {
+			LOG(WARN) << "Latest frame mode needs memory mapped capture buffers, all the frames of " << pipeline.m_source << " are kept";
+			pipeline.m_latest = false;
+		}
+	}
+	pipeline.m_mmapOutput.reset(new MmapOutput(pipeline.m_videoOutput));
+
+	LOG(NOTICE) << pipeline.m_source << " " << V4l2Device::fourcc(informat) << " " << width << "x" << height
+		<< " -> " << pipeline.m_dest << " " << V4l2Device::fourcc(outformat) << " " << outwidth << "x" << outheight
+		<< (pipeline.m_encoder ? " encode" : (pipeline.m_converter ? " convert" : " copy"))
+		<< (pipeline.m_cpus.empty() ? "" : " cpu:") << pipeline.m_cpus;
+	return true;
+}
+
+// dequeue a frame, process it and write it, called by one worker at a time
+void processPipeline(Pipeline & pipeline) {
+	CaptureBuffer capture;
+	const char* data = NULL;
+	int rsize = -1;
+	if (pipeline.m_mmapCapture->isReady()) {
+		unsigned int dropped = 0;
+		rsize = pipeline.m_latest ? pipeline.m_mmapCapture->dequeueLatest(capture, dropped) : pipeline.m_mmapCapture->dequeue(capture);
+		pipeline.m_drops += dropped;
+		data = capture.m_data;
+		if ( (rsize == -1) && (errno != EAGAIN) ) {
+			LOG(WARN) << "Cannot dequeue " << pipeline.m_source << " " << strerror(errno);
+			pipeline.m_failed = true;
+		}
+	} else {
+		rsize = pipeline.m_videoCapture->read(pipeline.m_inBuffer.data(), pipeline.m_inBuffer.size());
+		data = pipeline.m_inBuffer.data();
+		if ( (rsize == -1) && (errno != EAGAIN) ) {
+			LOG(WARN) << "Cannot read " << pipeline.m_source << " " << strerror(errno);
+			pipeline.m_failed = true;
+		}
+	}
+	if (rsize <= 0) {
+		return;
+	}
+
+	int informat = pipeline.m_videoCapture->getFormat();
+	V4l2OutputSink sink(pipeline.m_videoOutput, pipeline.m_mmapOutput.get());
+	if (pipeline.m_encoder) {
+		const char* input = data;
+		int size = rsize;
+		int format = informat;
+		if (pipeline.m_converter) {
+			size = pipeline.m_converter->convert(data, rsize, pipeline.m_outBuffer.data(), pipeline.m_outBuffer.size());
+			input = pipeline.m_outBuffer.data();
+			format = V4L2_PIX_FMT_YUV420;
+		}
+		pipeline.m_encoder->setFrameInfo(capture.m_info);
+		if (size > 0) {
+			pipeline.m_encoder->convertEncodeWrite(input, size, format, &sink);
+		}
+	} else if (pipeline.m_converter) {
+		int size = pipeline.m_converter->convert(data, rsize, pipeline.m_outBuffer.data(), pipeline.m_outBuffer.size());
+		if (size > 0) {
+			sink.setFrameInfo(capture.m_info);
+			sink.write(pipeline.m_outBuffer.data(), size);
+		}
+	} else {
+		sink.setFrameInfo(capture.m_info);
+		sink.write((char*)data, rsize);
+	}
+	pipeline.m_frames++;
+
+	if (capture.m_data) {
+		pipeline.m_mmapCapture->requeue(capture);
+	}
+}
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+	int verbose=0;
+	const char *config = NULL;
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	int c = 0;
+
+	while ((c = getopt (argc, argv, "hv::" "j:")) != -1)
+	{
+		switch (c)
+		{
+			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
+			case 'j':	threads = std::max(1, atoi(optarg)); break;
+			case 'h':
+			{
+				std::cout << argv[0] << " [-v[v]] [-j threads] config_file" << std::endl;
+				std::cout << "\t -v            : verbose " << std::endl;
+				std::cout << "\t -vv           : very verbose " << std::endl;
+				std::cout << "\t -j threads    : workers shared by the pipelines without cpu (default " << threads << ")" << std::endl;
+				std::cout << "\t config_file   : one pipeline per line : source_device dest_device [key=value ...]" << std::endl;
+				std::cout << "\t                 capture=<format> capture_size=WxH fps=<fps> : capture configuration" << std::endl;
+				std::cout << "\t                 format=<fourcc> size=WxH : output format (ie H264, MJPG, YU12) and size, encode or convert when it differs from the capture" << std::endl;
+				std::cout << "\t                 latest=1 : process only the latest captured frame" << std::endl;
+				std::cout << "\t                 cpu=0,2-3 : run the pipeline on workers pinned to these CPUs" << std::endl;
+				std::cout << "\t                 other keys are encoder options, ie vbr=1000 gop=25 preset=veryfast quality=80" << std::endl;
+				exit(0);
+			}
+		}
+	}
+	if (optind<argc)
+	{
+		config = argv[optind];
+		optind++;
+	}
+	if (config == NULL)
+	{
+		std::cout << "missing config_file" << std::endl;
+		exit(1);
+	}
+
+	// initialize log4cpp
+	initLogger(verbose);
+
+	// read the pipelines
+	std::ifstream file(config);
+	if (!file.is_open())
+	{
+		LOG(WARN) << "Cannot open config file:" << config << " " << strerror(errno);
+		return -1;
+	}
+	std::vector< std::unique_ptr<Pipeline> > pipelines;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		lineNumber++;
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) {
+			line.erase(comment);
+		}
+		if (line.find_first_not_of(" \t\r") == std::string::npos) {
+			continue;
+		}
+		std::unique_ptr<Pipeline> pipeline(new Pipeline());
+		if (!parsePipeline(line, *pipeline)) {
+			LOG(WARN) << "Cannot parse " << config << ":" << lineNumber << " " << line;
+		} else if (openPipeline(*pipeline, verbose)) {
+			pipelines.push_back(std::move(pipeline));
+		}
+	}
+	if (pipelines.empty())
+	{
+		LOG(WARN) << "No pipeline to run";
+		return -1;
+	}
+
+	// one group of workers for each CPU list, as many workers as CPUs
+	std::map< std::string, std::unique_ptr<WorkerGroup> > groups;
+	for (std::unique_ptr<Pipeline> & pipeline : pipelines) {
+		std::unique_ptr<WorkerGroup> & group = groups[pipeline->m_cpus];
+		if (!group) {
+			cpu_set_t set;
+			int count = pipeline->m_cpus.empty() ? threads : (parseCpuList(pipeline->m_cpus, set), CPU_COUNT(&set));
+			group.reset(new WorkerGroup(pipeline->m_cpus, count));
+		}
+		pipeline->m_group = group.get();
+	}
+
+	// a pipeline is watched again once its frame is processed, so it is never processed by two workers
+	int epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+	{
+		LOG(WARN) << "Cannot create epoll " << strerror(errno);
+		return -1;
+	}
+	for (unsigned int i = 0; i < pipelines.size(); ++i) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.u32 = i;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pipelines[i]->m_videoCapture->getFd(), &ev) == -1) {
+			LOG(WARN) << "Cannot watch " << pipelines[i]->m_source << " " << strerror(errno);
+			pipelines[i]->m_failed = true;
+		}
+	}
+
+	LOG(NOTICE) << "Start " << pipelines.size() << " pipelines with " << groups.size() << " worker groups";
+	signal(SIGINT,sighandler);
+	while (!stop)
+	{
+		struct epoll_event events[64];
+		int count = epoll_wait(epollfd, events, 64, 1000);
+		if ( (count == -1) && (errno != EINTR) )
+		{
+			LOG(NOTICE) << "stop " << strerror(errno);
+			stop=true;
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			unsigned int index = events[i].data.u32;
+			Pipeline* pipeline = pipelines[index].get();
+			if ( (events[i].events & (EPOLLERR|EPOLLHUP)) && !(events[i].events & EPOLLIN) ) {
+				LOG(WARN) << "Stop pipeline " << pipeline->m_source << " events:" << events[i].events;
+				pipeline->m_failed = true;
+				continue;
+			}
+			pipeline->m_group->push([pipeline, index, epollfd]() {
+				processPipeline(*pipeline);
+				if (!pipeline->m_failed && !stop) {
+					struct epoll_event ev;
+					memset(&ev, 0, sizeof(ev));
+					ev.events = EPOLLIN | EPOLLONESHOT;
+					ev.data.u32 = index;
+					epoll_ctl(epollfd, EPOLL_CTL_MOD, pipeline->m_videoCapture->getFd(), &ev);
+				}
+			});
+		}
+
+		// stop once no pipeline is left
+		bool alive = false;
+		for (std::unique_ptr<Pipeline> & pipeline : pipelines) {
+			alive = alive || !pipeline->m_failed;
+		}
+		if (!alive)
+		{
+			LOG(NOTICE) << "stop all pipelines failed";
+			stop=true;
+		}
+	}
+
+	// finish the jobs queued, then write the frames delayed in the encoders
+	groups.clear();
+	close(epollfd);
+	for (std::unique_ptr<Pipeline> & pipeline : pipelines) {
+		if (pipeline->m_encoder) {
+			V4l2OutputSink sink(pipeline->m_videoOutput, pipeline->m_mmapOutput.get());
+			pipeline->m_encoder->flush(&sink);
+		}
+		LOG(NOTICE) << pipeline->m_source << " -> " << pipeline->m_dest << " frames:" << pipeline->m_frames << " drops:" << pipeline->m_drops;
+	}
+
+	return 0;
+}
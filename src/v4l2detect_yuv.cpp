@@ -33,6 +33,9 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
+#include "yuvconverter.h"
+#include "latency.h"
+
 int stop=0;
 
 /* ---------------------------------------------------------------------------
@@ -56,8 +59,11 @@ int main(int argc, char* argv[])
 	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
 	V4l2Access::IoType ioTypeOut = V4l2Access::IOTYPE_MMAP;
 	std::string outFormatStr = "YU12";
+	int stripes = 1;
+	int statsPeriod = 0;
+	std::string statsFile;
 	
-	while ((c = getopt (argc, argv, "hv::" "o:" "rw")) != -1)
+	while ((c = getopt (argc, argv, "hv::" "o:" "j:" "i:I:" "rw")) != -1)
 	{
 		switch (c)
 		{
@@ -68,6 +74,9 @@ int main(int argc, char* argv[])
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -o <format>   : output YUV format" << std::endl;
+				std::cout << "\t -j stripes    : horizontal stripes converted in parallel (default 1)" << std::endl;
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
@@ -77,6 +86,9 @@ int main(int argc, char* argv[])
 			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;			
 			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;	
 			case 'o':       outFormatStr = optarg ; break;
+			case 'j':       stripes = atoi(optarg); break;
+			case 'i':       statsPeriod = atoi(optarg); break;
+			case 'I':       statsFile = optarg; break;
 			default:
 				std::cout << "option :" << c << " is unknown" << std::endl;
 				break;
@@ -138,13 +150,17 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
-				// intermediate I420 image
-				uint8 i420[width*height*2];
-				uint8* i420_p0=i420;
-				uint8* i420_p1=&i420[width*height];
-				uint8* i420_p2=&i420[width*height*3/2];								
+				YuvConverter converter(informat, outformat, width, height);
+				converter.setStripes(stripes);
+				std::vector<char> outBuffer(width*height*3);
 				
 				timeval tv;
+				LatencyStats stats(statsPeriod, statsFile);
+				LatencyHistogram & dequeue = stats.add("dequeue");
+				LatencyHistogram & convert = stats.add("convert");
+				LatencyHistogram & detect = stats.add("detect");
+				LatencyHistogram & write = stats.add("write");
+				stats.start();
 				
 				LOG(NOTICE) << "Start Copying from " << in_devname << " to " << out_devname; 
 				signal(SIGINT,sighandler);				
@@ -156,6 +172,7 @@ int main(int argc, char* argv[])
 					if (ret == 1)
 					{
 						char inbuffer[videoCapture->getBufferSize()];
+						uint64_t time = monotonicNow();
 						int rsize = videoCapture->read(inbuffer, sizeof(inbuffer));
 						if (rsize == -1)
 						{
@@ -164,27 +181,11 @@ int main(int argc, char* argv[])
 						}
 						else
 						{
-							libyuv::ConvertToI420((const uint8*)inbuffer, rsize,
-								i420_p0, width,
-								i420_p1, width/2,
-								i420_p2, width/2,
-								0, 0,
-								width, height,
-								width, height,
-								libyuv::kRotate0, informat);
-
-							
-							char outBuffer[width*height*3];
-							libyuv::ConvertFromI420(i420_p0, width,
-									i420_p1, width/2,
-									i420_p2, width/2,
-									(uint8*)outBuffer, 0,
-									width, height, 
-									outformat);
-							
-							
+							time = dequeue.recordSince(time);
+							converter.convert(inbuffer, rsize, outBuffer.data(), outBuffer.size());
+							time = convert.recordSince(time);
 
-							cv::Mat input(width, height, CV_8UC3, outBuffer);
+							cv::Mat input(width, height, CV_8UC3, outBuffer.data());
                                                         std::vector<cv::Rect> faces;
                                                         cascade.detectMultiScale( input, faces, 1.11, 4, 0);
 							LOG(NOTICE) << "faces " << faces.size(); 
@@ -193,8 +194,11 @@ int main(int argc, char* argv[])
 								LOG(NOTICE) << r.x << "x" << r.y << " -> " << r.x+r.width << "x" << r.y+r.height ;
 								cv::rectangle( input, r, cv::Scalar(255,0,0) );
 							}
+							time = detect.recordSince(time);
 							
 							int wsize = videoOutput->write((char*)input.data, width*height*3);
+							write.recordSince(time);
+							stats.frame();
 							LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
 							
 						}
@@ -24,6 +24,8 @@
 #include "V4l2Device.h"
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
+#include "devicefactory.h"
+#include "latency.h"
 
 #include "h264_stream.h"
 #include "hevc_stream.h"
@@ -49,20 +51,26 @@ int main(int argc, char* argv[])
 	const char *in_devname = "/dev/video0";	
 	int c = 0;
 	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
+	int statsPeriod = 0;
+	std::string statsFile;
 	
-	while ((c = getopt (argc, argv, "hP:F:v::rw")) != -1)
+	while ((c = getopt (argc, argv, "hP:F:v::rw" "i:I:")) != -1)
 	{
 		switch (c)
 		{
 			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
 			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;			
+			case 'i':	statsPeriod = atoi(optarg); break;
+			case 'I':	statsFile = optarg; break;
 			case 'h':
 			{
 				std::cout << argv[0] << " [-v[v]] [-W width] [-H height] source_device dest_device" << std::endl;
 				std::cout << "\t -v            : verbose " << std::endl;
 				std::cout << "\t -vv           : very verbose " << std::endl;
 				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
-				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t source_device : V4L2 capture device or file:/pipe: stand-in (default "<< in_devname << ")" << std::endl;
 				exit(0);
 			}
 		}
@@ -78,7 +86,7 @@ int main(int argc, char* argv[])
 
 	// init V4L2 capture interface
 	V4L2DeviceParameters param(in_devname, 0, 0, 0, 0,verbose);
-	V4l2Capture* videoCapture = V4l2Capture::create(param, ioTypeIn);
+	V4l2Capture* videoCapture = DeviceFactory::CreateCapture(param, ioTypeIn);
 	
 	if (videoCapture == NULL)
 	{	
@@ -90,6 +98,10 @@ int main(int argc, char* argv[])
 		hevc_stream_t* hevc = hevc_new();
 		
 		timeval tv;
+		LatencyStats stats(statsPeriod, statsFile);
+		LatencyHistogram & dequeue = stats.add("dequeue");
+		LatencyHistogram & parse = stats.add("parse");
+		stats.start();
 		
 		LOG(NOTICE) << "Start reading from " << in_devname ; 
 		signal(SIGINT,sighandler);				
@@ -101,6 +113,7 @@ int main(int argc, char* argv[])
 			if (ret == 1)
 			{
 				char buffer[videoCapture->getBufferSize()];
+				uint64_t time = monotonicNow();
 				int rsize = videoCapture->read(buffer, sizeof(buffer));
 				if (rsize == -1)
 				{
@@ -109,6 +122,7 @@ int main(int argc, char* argv[])
 				}
 				else
 				{
+					time = dequeue.recordSince(time);
 					int nal_start = 0, nal_end = 0;
 					uint8_t* p = (uint8_t*)buffer;
 					LOG(DEBUG) << "size:" << rsize;
@@ -140,6 +154,8 @@ int main(int argc, char* argv[])
 						}
 					}
 #endif
+					parse.recordSince(time);
+					stats.frame();
 				}
 			}
 			else if (ret == -1)
@@ -25,6 +25,8 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
+#include "latency.h"
+
 int stop=0;
 
 
@@ -65,9 +67,11 @@ int main(int argc, char* argv[])
     	int width = 640;
     	int height = 480;
 	int fps = 25;
+	int statsPeriod = 0;
+	std::string statsFile;
 	
 	int c = 0;
-	while ((c = getopt (argc, argv, "hP:F:v::w" "W:H:F:")) != -1)
+	while ((c = getopt (argc, argv, "hP:F:v::w" "W:H:F:" "i:I:")) != -1)
 	{
 		switch (c)
 		{
@@ -77,6 +81,8 @@ int main(int argc, char* argv[])
 			case 'W':	width = atoi(optarg); break;
 			case 'H':	height = atoi(optarg); break;
 			case 'F':	fps = atoi(optarg); break;			
+			case 'i':	statsPeriod = atoi(optarg); break;
+			case 'I':	statsFile = optarg; break;
 			
 			case 'h':
 			{
@@ -86,6 +92,8 @@ int main(int argc, char* argv[])
 				std::cout << "\t -W width      : V4L2 capture width (default "<< width << ")" << std::endl;
 				std::cout << "\t -H height     : V4L2 capture height (default "<< height << ")" << std::endl;
 				std::cout << "\t -F fps        : V4L2 capture framerate (default "<< fps << ")" << std::endl;				
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
 				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t dest_device   : V4L2 capture device (default "<< out_devname << ")" << std::endl;
 				exit(0);
@@ -115,9 +123,14 @@ int main(int argc, char* argv[])
 		int i=0;
 		int picture_size = videoOutput->getBufferSize();
 		char buffer[picture_size]; 
+		LatencyStats stats(statsPeriod, statsFile);
+		LatencyHistogram & generate = stats.add("generate");
+		LatencyHistogram & write = stats.add("write");
+		stats.start();
 		
 		while (!stop) 
 		{
+			uint64_t time = monotonicNow();
 			int rsize = getFrame(buffer, sizeof(buffer), width, height, i++);
 			if (rsize == -1)
 			{
@@ -126,7 +139,10 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
+				time = generate.recordSince(time);
 				int wsize = videoOutput->write(buffer, rsize);
+				write.recordSince(time);
+				stats.frame();
 				LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
 				usleep(1000000/fps);
 			}
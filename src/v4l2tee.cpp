@@ -0,0 +1,325 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** v4l2tee.cpp
+**
+** Copy from a V4L2 capture device to several V4L2 output devices
+**
+** -------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "logger.h"
+
+#include "V4l2Device.h"
+#include "V4l2Capture.h"
+#include "V4l2Output.h"
+
+#include "spscqueue.h"
+#include "mmapcapture.h"
+#include "latency.h"
+
+std::atomic<bool> stop(false);
+
+/* ---------------------------------------------------------------------------
+**  SIGINT handler
+** -------------------------------------------------------------------------*/
+void sighandler(int)
+{
+       printf("SIGINT\n");
+       stop = true;
+}
+
+// a captured frame shared by the outputs, it could be reused when no output hold it
+struct SharedFrame {
+	SharedFrame() : m_size(0), m_refs(0), m_time(0) {}
+
+	std::vector<char> m_buffer;
+	unsigned int      m_size;
+	std::atomic<int>  m_refs;
+	uint64_t          m_time;
+};
+
+// an output device with its own queue and writing thread
+struct TeeOutput {
+	TeeOutput(V4l2Output* videoOutput, const char* devname, size_t depth, LatencyHistogram & queued, LatencyHistogram & write)
+		: m_videoOutput(videoOutput), m_devname(devname), m_queue(depth), m_frames(0), m_drops(0), m_queued(queued), m_write(write) {}
+
+	~TeeOutput() {
+		delete m_videoOutput;
+	}
+
+	V4l2Output*                m_videoOutput;
+	std::string                m_devname;
+	SpscQueue<SharedFrame*>    m_queue;
+	std::atomic<unsigned long> m_frames;
+	std::atomic<unsigned long> m_drops;
+	LatencyHistogram &         m_queued;
+	LatencyHistogram &         m_write;
+	std::thread                m_thread;
+};
+
+// write the frames queued for an output, then release them
+void writeOutput(TeeOutput* output, std::atomic<bool> & stop) {
+	while (!stop) {
+		SharedFrame** slot = output->m_queue.front();
+		if (slot == NULL) {
+			waitQueue();
+			continue;
+		}
+		SharedFrame* frame = *slot;
+		output->m_queue.pop();
+		uint64_t time = output->m_queued.recordSince(frame->m_time);
+
+		timeval tv;
+		tv.tv_sec=1;
+		tv.tv_usec=0;
+		if (output->m_videoOutput->isWritable(&tv) == 1) {
+			int wsize = output->m_videoOutput->write(frame->m_buffer.data(), frame->m_size);
+			output->m_write.recordSince(time);
+			LOG(DEBUG) << "Copied to " << output->m_devname << " " << frame->m_size << " " << wsize;
+			output->m_frames++;
+		} else {
+			output->m_drops++;
+		}
+		frame->m_refs.fetch_sub(1, std::memory_order_release);
+	}
+	while (SharedFrame** slot = output->m_queue.front()) {
+		(*slot)->m_refs.fetch_sub(1, std::memory_order_release);
+		output->m_queue.pop();
+	}
+}
+
+// a frame that no output holds, NULL if all are in use
+SharedFrame* getFreeFrame(std::vector<SharedFrame> & frames) {
+	for (SharedFrame & frame : frames) {
+		if (frame.m_refs.load(std::memory_order_acquire) == 0) {
+			return &frame;
+		}
+	}
+	return NULL;
+}
+
+// give the frame to each output that has room for it, a slow output drops it
+void dispatch(SharedFrame* frame, std::vector<std::unique_ptr<TeeOutput>> & outputs) {
+	// hold the frame until all the outputs got it
+	frame->m_refs.store(outputs.size()+1, std::memory_order_relaxed);
+	int refused = 1;
+	for (std::unique_ptr<TeeOutput> & output : outputs) {
+		SharedFrame** slot = output->m_queue.back();
+		if (slot == NULL) {
+			output->m_drops++;
+			refused++;
+		} else {
+			*slot = frame;
+			output->m_queue.push();
+		}
+	}
+	frame->m_refs.fetch_sub(refused, std::memory_order_release);
+}
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+	int verbose=0;
+	const char *in_devname = "/dev/video0";
+	std::vector<const char*> out_devnames;
+	int depth = 2;
+	int c = 0;
+	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
+	V4l2Access::IoType ioTypeOut = V4l2Access::IOTYPE_MMAP;
+	int statsPeriod = 0;
+	std::string statsFile;
+
+	while ((c = getopt (argc, argv, "hv::rw" "d:" "i:I:")) != -1)
+	{
+		switch (c)
+		{
+			case 'v':	verbose   = 1; if (optarg && *optarg=='v') verbose++;  break;
+			case 'r':	ioTypeIn  = V4l2Access::IOTYPE_READWRITE; break;
+			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;
+			case 'd':	depth = std::max(1, atoi(optarg)); break;
+			case 'i':	statsPeriod = atoi(optarg); break;
+			case 'I':	statsFile = optarg; break;
+			case 'h':
+			{
+				std::cout << argv[0] << " [-v[v]] [-r] [-w] [-d depth] [-i seconds] [-I file] source_device dest_device [dest_device ...]" << std::endl;
+				std::cout << "\t -v            : verbose " << std::endl;
+				std::cout << "\t -vv           : very verbose " << std::endl;
+				std::cout << "\t -d depth      : frames queued for each output before dropping (default " << depth << ")" << std::endl;
+				std::cout << "\t -i seconds    : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I file       : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t -r            : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
+				std::cout << "\t -w            : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
+				std::cout << "\t source_device : V4L2 capture device (default "<< in_devname << ")" << std::endl;
+				std::cout << "\t dest_device   : V4L2 output devices" << std::endl;
+				exit(0);
+			}
+		}
+	}
+	if (optind<argc)
+	{
+		in_devname = argv[optind];
+		optind++;
+	}
+	while (optind<argc)
+	{
+		out_devnames.push_back(argv[optind]);
+		optind++;
+	}
+	if (out_devnames.empty())
+	{
+		out_devnames.push_back("/dev/video1");
+	}
+
+	// initialize log4cpp
+	initLogger(verbose);
+
+	// init V4L2 capture interface
+	V4L2DeviceParameters param(in_devname, 0, 0, 0, 0,verbose);
+	V4l2Capture* videoCapture = V4l2Capture::create(param, ioTypeIn);
+
+	if (videoCapture == NULL)
+	{
+		LOG(WARN) << "Cannot create V4L2 capture interface for device:" << in_devname;
+	}
+	else
+	{
+		// the outputs share the queued and write stages
+		LatencyStats stats(statsPeriod, statsFile);
+		LatencyHistogram & dequeue = stats.add("dequeue");
+		LatencyHistogram & queued = stats.add("queued");
+		LatencyHistogram & write = stats.add("write");
+
+		// init V4L2 output interfaces
+		std::vector<std::unique_ptr<TeeOutput>> outputs;
+		for (const char* out_devname : out_devnames)
+		{
+			V4L2DeviceParameters outparam(out_devname, videoCapture->getFormat(), videoCapture->getWidth(), videoCapture->getHeight(), 0,verbose);
+			V4l2Output* videoOutput = V4l2Output::create(outparam, ioTypeOut);
+			if (videoOutput == NULL)
+			{
+				LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname;
+			}
+			else
+			{
+				outputs.push_back(std::unique_ptr<TeeOutput>(new TeeOutput(videoOutput, out_devname, depth, queued, write)));
+			}
+		}
+
+		if (!outputs.empty())
+		{
+			// enough frames for full queues, the frames being written and the one being captured
+			unsigned int bufferSize = videoCapture->getBufferSize();
+			if (bufferSize == 0) {
+				// for buggy drivers
+				bufferSize = videoCapture->getWidth()*videoCapture->getHeight()*3;
+			}
+			std::vector<SharedFrame> frames(outputs.size()*(depth+1) + 1);
+			for (SharedFrame & frame : frames) {
+				frame.m_buffer.resize(bufferSize);
+			}
+			std::vector<char> scratch(bufferSize);
+			unsigned long captureDrops = 0;
+
+			for (std::unique_ptr<TeeOutput> & output : outputs) {
+				output->m_thread = std::thread(writeOutput, output.get(), std::ref(stop));
+			}
+
+			MmapCapture mmapCapture(videoCapture);
+			timeval tv;
+			stats.start();
+
+			LOG(NOTICE) << "Start Copying from " << in_devname << " to " << outputs.size() << " outputs";
+			signal(SIGINT,sighandler);
+			while (!stop)
+			{
+				tv.tv_sec=1;
+				tv.tv_usec=0;
+				int ret = videoCapture->isReadable(&tv);
+				if (ret == 1)
+				{
+					SharedFrame* frame = getFreeFrame(frames);
+					uint64_t time = monotonicNow();
+					int rsize = -1;
+					if (mmapCapture.isReady())
+					{
+						// copy once from the capture buffer, then give it back to the driver
+						CaptureBuffer buffer;
+						rsize = mmapCapture.dequeue(buffer);
+						if (rsize != -1)
+						{
+							if (frame)
+							{
+								rsize = std::min((unsigned int)rsize, (unsigned int)frame->m_buffer.size());
+								memcpy(frame->m_buffer.data(), buffer.m_data, rsize);
+							}
+							mmapCapture.requeue(buffer);
+						}
+						else if (errno == EAGAIN)
+						{
+							continue;
+						}
+					}
+					else
+					{
+						char* data = frame ? frame->m_buffer.data() : scratch.data();
+						rsize = videoCapture->read(data, bufferSize);
+					}
+
+					if (rsize == -1)
+					{
+						LOG(NOTICE) << "stop " << strerror(errno);
+						stop=true;
+					}
+					else if (frame == NULL)
+					{
+						// all the outputs are late
+						captureDrops++;
+					}
+					else
+					{
+						frame->m_size = rsize;
+						frame->m_time = dequeue.recordSince(time);
+						stats.frame();
+						dispatch(frame, outputs);
+					}
+				}
+				else if (ret == -1)
+				{
+					LOG(NOTICE) << "stop " << strerror(errno);
+					stop=true;
+				}
+			}
+
+			stop=true;
+			stats.stop();
+			for (std::unique_ptr<TeeOutput> & output : outputs) {
+				output->m_thread.join();
+				LOG(NOTICE) << output->m_devname << " frames:" << output->m_frames << " drops:" << output->m_drops;
+			}
+			if (captureDrops) {
+				LOG(NOTICE) << "frames dropped with all outputs late:" << captureDrops;
+			}
+		}
+		delete videoCapture;
+	}
+
+	return 0;
+}
@@ -19,6 +19,9 @@
 #include <signal.h>
 
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
 
 #include "logger.h"
 
@@ -26,9 +29,19 @@
 #include "V4l2Capture.h"
 #include "V4l2Output.h"
 
-#include <jpeglib.h>
+#include "jpegdecoder.h"
+#include "spscqueue.h"
+#include "latency.h"
+#include "metrics.h"
+#include "realtime.h"
 
-int stop=0;
+#ifdef HAVE_TURBOJPEG
+typedef TurboJpegDecoder Decoder;
+#else
+typedef JpegDecoder Decoder;
+#endif
+
+std::atomic<bool> stop(false);
 
 /* ---------------------------------------------------------------------------
 **  SIGINT handler
@@ -36,48 +49,162 @@ int stop=0;
 void sighandler(int)
 { 
        printf("SIGINT\n");
-       stop =1;
+       stop = true;
 }
 
 /* ---------------------------------------------------------------------------
-**  convert yuyv -> jpeg
+**  frame slots of the worker queues
 ** -------------------------------------------------------------------------*/
-void jpeg2yuyv(unsigned char* jpegBuffer, unsigned int jpegSize, unsigned char *  & image_buffer, unsigned int & image_size)
+struct JpegFrame {
+	JpegFrame() : m_size(0) {}
+	std::vector<char> m_buffer;
+	unsigned int      m_size;
+};
+
+struct ImageFrame {
+	ImageFrame() : m_size(0) {}
+	std::vector<unsigned char> m_buffer;
+	unsigned int               m_size;
+};
+
+/* ---------------------------------------------------------------------------
+**  timing of the stages, capture jitter and counters
+** -------------------------------------------------------------------------*/
+struct UncompressStats {
+	UncompressStats(int period, const std::string & filename, const std::string & metricsAddress, uint64_t interval)
+		: m_stats(period, filename)
+		, m_dequeue(m_stats.add("dequeue"))
+		, m_decode(m_stats.add("decode"))
+		, m_write(m_stats.add("write"))
+		, m_jitter(m_stats.add("jitter"))
+		, m_jitterMeter(m_jitter, interval)
+		, m_metrics(&m_stats)
+		, m_server(m_metrics, metricsAddress) {
+		m_metrics.setFrameInterval(interval);
+		LOG(NOTICE) << "Frame interval:" << interval/1e6 << "ms";
+		m_stats.start();
+		m_server.start();
+	}
+
+	LatencyStats       m_stats;
+	LatencyHistogram & m_dequeue;
+	LatencyHistogram & m_decode;
+	LatencyHistogram & m_write;
+	LatencyHistogram & m_jitter;
+	JitterMeter        m_jitterMeter;
+	Metrics            m_metrics;
+	MetricsServer      m_server;
+};
+
+/* ---------------------------------------------------------------------------
+**  uncompress frames in parallel, frame N is given to worker N%workers 
+**  and the writer reads the workers in the same order to keep the capture order
+** -------------------------------------------------------------------------*/
+void uncompressParallel(V4l2Capture* videoCapture, V4l2Output* videoOutput, int scale, int workers, int depth, const Realtime & realtime, UncompressStats & stats)
 {
-	struct jpeg_error_mgr jerr;
-	struct jpeg_decompress_struct cinfo;	
-	jpeg_create_decompress(&cinfo);
-	cinfo.err = jpeg_std_error(&jerr);
-	
-	jpeg_mem_src(&cinfo, jpegBuffer, jpegSize);	
-	jpeg_read_header(&cinfo, TRUE);
-	LOG(INFO) << "width:" << cinfo.image_width << " height:" << cinfo.image_height << " num_components:" << cinfo.num_components; 
-	
-	jpeg_start_decompress(&cinfo);
-	
-	image_size = cinfo.image_width * cinfo.image_height *  2;
-	image_buffer = (unsigned char*) malloc(image_size);	
-	
-	unsigned char bufline[cinfo.image_width * cinfo.num_components]; 
-	while (cinfo.output_scanline < cinfo.output_height) {
-		int rowIndex = cinfo.output_scanline ;
-		
-		JSAMPROW row = bufline; 
-		jpeg_read_scanlines(&cinfo, &row, 1);
-
-		// convert line from YUV -> YUYV 
-		unsigned int base = rowIndex*cinfo.image_width * 2;
-		for (unsigned int i = 0; i < cinfo.image_width; i += 2) 
-		{ 			
-			image_buffer[base + i*2    ] = bufline[i*3 ]; 
-			image_buffer[base + i*2+1] = (bufline[i*3+1] + bufline[i*3+4])/2; 
-			image_buffer[base + i*2+2] = bufline[i*3+3];  
-			image_buffer[base + i*2+3] = (bufline[i*3+2] + bufline[i*3+5])/2; 			
-		} 
-	}	
-	
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
+	std::vector< std::unique_ptr< SpscQueue<JpegFrame> > > inQueues;
+	std::vector< std::unique_ptr< SpscQueue<ImageFrame> > > outQueues;
+	for (int i = 0; i < workers; ++i) {
+		inQueues.emplace_back(new SpscQueue<JpegFrame>(depth));
+		outQueues.emplace_back(new SpscQueue<ImageFrame>(depth));
+		for (JpegFrame & frame : inQueues.back()->slots()) {
+			frame.m_buffer.resize(videoCapture->getBufferSize());
+		}
+		SpscQueue<JpegFrame>* inQueue = inQueues.back().get();
+		SpscQueue<ImageFrame>* outQueue = outQueues.back().get();
+		stats.m_metrics.addQueue("decode" + std::to_string(i), [inQueue]() { return inQueue->size(); }, inQueue->capacity());
+		stats.m_metrics.addQueue("write" + std::to_string(i), [outQueue]() { return outQueue->size(); }, outQueue->capacity());
+	}
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < workers; ++i) {
+		threads.push_back(std::thread([&, i]() {
+			realtime.apply("encode");
+			Decoder decoder(videoOutput->getFormat(), scale);
+			while (!stop) {
+				JpegFrame* in = inQueues[i]->front();
+				ImageFrame* out = outQueues[i]->back();
+				if (!in || !out) {
+					waitQueue();
+					continue;
+				}
+				// an empty frame is still pushed to keep the order
+				uint64_t time = monotonicNow();
+				out->m_size = decoder.decode((unsigned char *)in->m_buffer.data(), in->m_size, out->m_buffer);
+				stats.m_decode.recordSince(time);
+				inQueues[i]->pop();
+				outQueues[i]->push();
+			}
+		}));
+	}
+
+	threads.push_back(std::thread([&]() {
+		realtime.apply("output");
+		int worker = 0;
+		while (!stop) {
+			ImageFrame* frame = outQueues[worker]->front();
+			if (!frame) {
+				waitQueue();
+				continue;
+			}
+			if (frame->m_size) {
+				uint64_t time = monotonicNow();
+				int wsize = videoOutput->write((char*)frame->m_buffer.data(), frame->m_size);
+				stats.m_write.recordSince(time);
+				stats.m_metrics.written(wsize);
+				stats.m_stats.frame();
+				LOG(DEBUG) << "Copied worker:" << worker << " " << wsize; 
+			} else {
+				stats.m_metrics.drop();
+			}
+			outQueues[worker]->pop();
+			worker = (worker+1)%workers;
+		}
+	}));
+
+	realtime.apply("capture");
+	int worker = 0;
+	timeval tv;
+	while (!stop) 
+	{
+		JpegFrame* frame = inQueues[worker]->back();
+		if (!frame) {
+			waitQueue();
+			continue;
+		}
+		tv.tv_sec=1;
+		tv.tv_usec=0;
+		int ret = videoCapture->isReadable(&tv);
+		if (ret == 1)
+		{
+			uint64_t time = monotonicNow();
+			int rsize = videoCapture->read(frame->m_buffer.data(), frame->m_buffer.size());
+			if (rsize == -1)
+			{
+				LOG(NOTICE) << "stop " << strerror(errno); 
+				stop=true;					
+			}
+			else
+			{
+				stats.m_jitterMeter.tick(time);
+				stats.m_dequeue.recordSince(time);
+				stats.m_metrics.in();
+				frame->m_size = rsize;
+				inQueues[worker]->push();
+				worker = (worker+1)%workers;
+			}
+		}
+		else if (ret == -1)
+		{
+			LOG(NOTICE) << "stop " << strerror(errno); 
+			stop=true;
+		}
+	}
+
+	for (std::thread & thread : threads) {
+		thread.join();
+	}
+	stats.m_metrics.removeQueues();
 }
 
 /* ---------------------------------------------------------------------------
@@ -93,9 +220,17 @@ int main(int argc, char* argv[])
 	int fps = 25;	
 	V4l2Access::IoType ioTypeIn  = V4l2Access::IOTYPE_MMAP;
 	V4l2Access::IoType ioTypeOut = V4l2Access::IOTYPE_MMAP;
+	std::string outFormatStr = "YUYV";
+	int scale = 1;
+	int workers = 1;
+	int depth = 2;
+	int statsPeriod = 0;
+	std::string statsFile;
+	std::string metricsAddress;
+	Realtime realtime;
 	
 	int c = 0;
-	while ((c = getopt (argc, argv, "h" "W:H:F:" "rw" )) != -1)
+	while ((c = getopt (argc, argv, "h" "W:H:F:" "rw" "o:s:" "j:d:" "i:I:M:" "x:a:k" )) != -1)
 	{
 		switch (c)
 		{
@@ -109,6 +244,20 @@ int main(int argc, char* argv[])
 			
 			// output options
 			case 'w':	ioTypeOut = V4l2Access::IOTYPE_READWRITE; break;	
+			case 'o':	outFormatStr = optarg; break;
+			case 's':	scale = atoi(optarg); break;
+			case 'j':	workers = std::max(1, atoi(optarg)); break;
+			case 'd':	depth = std::max(1, atoi(optarg)); break;
+
+			// latency statistics
+			case 'i':	statsPeriod = atoi(optarg); break;
+			case 'I':	statsFile = optarg; break;
+			case 'M':	metricsAddress = optarg; break;
+
+			// scheduling
+			case 'x':	if (!realtime.parsePolicy(optarg)) { std::cout << "unsupported scheduling:" << optarg << std::endl; exit(1); } break;
+			case 'a':	if (!realtime.parseAffinity(optarg)) { std::cout << "unsupported CPU list:" << optarg << std::endl; exit(1); } break;
+			case 'k':	realtime.setLockMemory(true); break;
 			
 			case 'h':
 			{
@@ -120,6 +269,16 @@ int main(int argc, char* argv[])
 				std::cout << "\t -F fps           : V4L2 capture framerate (default "<< fps << ")" << std::endl;
 				std::cout << "\t -r               : V4L2 capture using read interface (default use memory mapped buffers)" << std::endl;
 				std::cout << "\t -w               : V4L2 capture using write interface (default use memory mapped buffers)" << std::endl;
+				std::cout << "\t -o <format>      : output format YUYV, UYVY or YU12 (default " << outFormatStr << ")" << std::endl;
+				std::cout << "\t -s <scale>       : uncompress at 1/scale of the capture size (1, 2, 4 or 8)" << std::endl;
+				std::cout << "\t -j <workers>     : uncompress frames in parallel with several workers (default " << workers << ")" << std::endl;
+				std::cout << "\t -d <depth>       : frames queued per worker (default " << depth << ")" << std::endl;
+				std::cout << "\t -i <seconds>     : print the latency percentiles of each stage with this period" << std::endl;
+				std::cout << "\t -I <file>        : append the latency percentiles to this file instead of the log" << std::endl;
+				std::cout << "\t -M <address>     : serve the counters in Prometheus format on [host:]port (localhost by default) or unix:path" << std::endl;
+				std::cout << "\t -x fifo|rr[:prio]: real-time scheduling of the capture, decode and write threads" << std::endl;
+				std::cout << "\t -a <cpus>        : pin the threads to a CPU list (0,2-3), or capture=0:encode=1-3:output=0 per role (encode are the decoders)" << std::endl;
+				std::cout << "\t -k               : lock the memory to avoid page faults" << std::endl;
 				
 				std::cout << "\tcompressor options" << std::endl;
 				std::cout << "\t -q <quality>     : JPEG quality" << std::endl;
@@ -141,6 +300,11 @@ int main(int argc, char* argv[])
 		optind++;
 	}	
 		
+	if ( (scale != 1) && (scale != 2) && (scale != 4) && (scale != 8) ) {
+		std::cout << "unsupported scale:" << scale << std::endl;
+		exit(1);
+	}
+		
 	// initialize log4cpp
 	initLogger(verbose);
 
@@ -155,15 +319,31 @@ int main(int argc, char* argv[])
 	else
 	{
 		// init V4L2 output interface
-		V4L2DeviceParameters outparam(out_devname, V4L2_PIX_FMT_YUYV, videoCapture->getWidth(), videoCapture->getHeight(), 0, verbose);
+		int outformat = V4l2Device::fourcc(outFormatStr.c_str());
+		int outwidth = (videoCapture->getWidth() + scale - 1)/scale;
+		int outheight = (videoCapture->getHeight() + scale - 1)/scale;
+		V4L2DeviceParameters outparam(out_devname, outformat, outwidth, outheight, 0, verbose);
 		V4l2Output* videoOutput = V4l2Output::create(outparam, ioTypeOut);
 		if (videoOutput == NULL)
 		{	
 			LOG(WARN) << "Cannot create V4L2 output interface for device:" << out_devname; 
 		}
+		else if (workers > 1)
+		{
+			UncompressStats stats(statsPeriod, statsFile, metricsAddress, frameInterval(videoCapture->getFd()));
+			realtime.lockMemory();
+			LOG(NOTICE) << "Start Uncompressing " << in_devname << " to " << out_devname << " with " << workers << " workers"; 
+			signal(SIGINT,sighandler);
+			uncompressParallel(videoCapture, videoOutput, scale, workers, depth, realtime, stats);
+			delete videoOutput;
+		}
 		else
 		{		
+			Decoder decoder(videoOutput->getFormat(), scale);
+			UncompressStats stats(statsPeriod, statsFile, metricsAddress, frameInterval(videoCapture->getFd()));
 			timeval tv;
+			realtime.lockMemory();
+			realtime.apply("capture");
 			
 			LOG(NOTICE) << "Start Uncompressing " << in_devname << " to " << out_devname; 					
 			signal(SIGINT,sighandler);
@@ -175,31 +355,38 @@ int main(int argc, char* argv[])
 				if (ret == 1)
 				{
 					char buffer[videoCapture->getBufferSize()];
+					uint64_t time = monotonicNow();
 					int rsize = videoCapture->read(buffer, sizeof(buffer));
 					if (rsize == -1)
 					{
 						LOG(NOTICE) << "stop " << strerror(errno); 
-						stop=1;					
+						stop=true;					
 					}
 					else
 					{												
-						// compress
-						unsigned char * outBuffer = NULL;
-						unsigned int outSize = 0;
-						jpeg2yuyv((unsigned char *)buffer, rsize, outBuffer, outSize);							
+						stats.m_jitterMeter.tick(time);
+						time = stats.m_dequeue.recordSince(time);
+						stats.m_metrics.in();
+
+						// uncompress
+						unsigned int outSize = decoder.decode((unsigned char *)buffer, rsize);
+						time = stats.m_decode.recordSince(time);
 
-						if (outBuffer) {
-							int wsize = videoOutput->write((char*)outBuffer, outSize);
+						if (outSize) {
+							int wsize = videoOutput->write((char*)decoder.data(), outSize);
+							stats.m_write.recordSince(time);
+							stats.m_metrics.written(wsize);
+							stats.m_stats.frame();
 							LOG(DEBUG) << "Copied " << rsize << " " << wsize; 
-							
-							free(outBuffer);
+						} else {
+							stats.m_metrics.drop();
 						}
 					}
 				}
 				else if (ret == -1)
 				{
 					LOG(NOTICE) << "stop " << strerror(errno); 
-					stop=1;
+					stop=true;
 				}
 			}
 			delete videoOutput;